@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "config.h"
+#include "orbit.h"
+#include "render.h"
+#include "statefile.h"
+#include "bmp.h"
+#include "color.h"
+#include "rng.h"
+#include "stats.h"
+
+/*
+ * Microbenchmarks of the hot paths (make bench). Every benchmark repeats its operation until it ran
+ * for at least BENCH_MIN_NS and prints one tab separated line:
+ * name, width, height, iters, ops, ns/op, throughput (ops/s) and what an op is.
+ * All input data is derived from BENCH_SEED, so runs are comparable.
+ */
+#define BENCH_MIN_NS    200000000ULL
+#define BENCH_SEED      0x6e6562756c6132ULL
+#define BENCH_BLOCK     1024
+#define BENCH_STATEFILE "bench.state"
+#define BENCH_OUTPUT    "bench.bmp"
+
+typedef struct {
+	int width, height;
+} bench_size_t;
+
+typedef struct {
+	int iters_n;
+	int iters[4];
+} bench_iters_t;
+
+static const bench_size_t bench_sizes[] = {
+	{ 256,  192  },
+	{ 1024, 768  },
+	{ 2048, 1536 },
+};
+
+static const bench_iters_t bench_iters[] = {
+	{ 3, { 20, 200, 2000 } },
+	{ 4, { 100, 1000, 10000, 100000 } },
+};
+
+static color_t bench_colors[] = {
+	{ 0,   0,   136 },
+	{ 0,   255, 0   },
+	{ 255, 0,   0   },
+	{ 255, 255, 255 },
+};
+
+#define N_SIZES (sizeof(bench_sizes) / sizeof(bench_size_t))
+#define N_ITERS (sizeof(bench_iters) / sizeof(bench_iters_t))
+
+/* A config like the defaults of config.c */
+static void
+bench_conf(config_t* conf, const bench_size_t* size, const bench_iters_t* iters) {
+	memset(conf, 0, sizeof(config_t));
+
+	conf->width       = size->width;
+	conf->height      = size->height;
+	conf->iters_n     = iters->iters_n;
+	conf->iters       = (int*) iters->iters;
+	conf->colors      = bench_colors;
+	conf->statefile   = BENCH_STATEFILE;
+	conf->output      = BENCH_OUTPUT;
+	conf->kernel      = KERNEL_SIMD;
+	conf->bulbtest    = 1;
+	conf->precision   = PRECISION_DOUBLE;
+	conf->periodcheck = 16;
+	conf->periodeps   = 1e-12;
+	conf->sampler     = SAMPLER_UNIFORM;
+	conf->symmetry    = SYMMETRY_OFF;
+}
+
+static size_t
+bench_mapsize(config_t* conf) {
+	return (size_t) conf_map_width(conf) * conf->height * conf->iters_n;
+}
+
+static void
+report(const char* name, config_t* conf, uint64_t ops, uint64_t ns, const char* op) {
+	int i;
+
+	printf("%s\t%d\t%d\t", name, conf->width, conf->height);
+	for(i = 0; i < conf->iters_n; i++) {
+		printf((i > 0) ? ",%d" : "%d", conf->iters[i]);
+	}
+	printf("\t%" PRIu64 "\t%.3f\t%.0f\t%s\n", ops, (double) ns / ops, ops / (ns / 1e9), op);
+	fflush(stdout);
+}
+
+/* BENCH_BLOCK samples of the sampled rectangle */
+static void
+bench_samples(config_t* conf, double* cx, double* cy) {
+	uint64_t lo[BENCH_BLOCK], hi[BENCH_BLOCK];
+	double   conv, mult_x, mult_y;
+	int      hw, hh, i;
+
+	precalc_nebula_params(conf, &conv, &mult_x, &mult_y, &hw, &hh);
+	philox_fill(BENCH_SEED, 0, BENCH_BLOCK, lo, hi);
+	for(i = 0; i < BENCH_BLOCK; i++) {
+		random_to_c(lo[i], mult_x, mult_y, cx + i, cy + i);
+	}
+}
+
+/*
+ * A map with the spatial coherence of a real one (render's lookup relies on it): a smooth pattern
+ * whose range grows with the layer, plus some noise.
+ */
+static void
+bench_map(config_t* conf, uint32_t* map) {
+	uint64_t r[BENCH_BLOCK], unused[BENCH_BLOCK];
+	size_t   i, n = bench_mapsize(conf);
+	int      x, y, l, w = conf_map_width(conf);
+
+	for(i = 0; i < n; i++) {
+		if(i % BENCH_BLOCK == 0) {
+			philox_fill(BENCH_SEED, i, BENCH_BLOCK, r, unused);
+		}
+		l = i / ((size_t) w * conf->height);
+		x = i % w;
+		y = (i / w) % conf->height;
+
+		map[i] = (uint32_t) ((100 << l) * (1.0 + sin(x * 0.05) * cos(y * 0.07))) + r[i % BENCH_BLOCK] % 8;
+	}
+}
+
+/* The orbit kernel alone (escape iterations, nothing is scattered) */
+static void
+bench_kernel(config_t* conf, int kernel, const char* name) {
+	orbit_ctx_t ctx;
+	double      cx[BENCH_BLOCK], cy[BENCH_BLOCK];
+	int         escape[BENCH_BLOCK];
+	uint64_t    start, ops = 0;
+
+	if(!orbit_ctx_init(&ctx, conf, NULL)) {
+		return;
+	}
+	bench_samples(conf, cx, cy);
+
+	start = now_ns();
+	do {
+		orbit_escape(&ctx, kernel, cx, cy, BENCH_BLOCK, escape);
+		ops += BENCH_BLOCK;
+	} while(now_ns() - start < BENCH_MIN_NS);
+	report(name, conf, ops, now_ns() - start, "sample");
+
+	orbit_ctx_cleanup(&ctx);
+}
+
+/* The whole single pass kernel: iterate, record and scatter */
+static void
+bench_trace(config_t* conf, uint32_t* map) {
+	orbit_ctx_t ctx;
+	double      cx[BENCH_BLOCK], cy[BENCH_BLOCK];
+	uint64_t    start, ops = 0;
+
+	if(!orbit_ctx_init(&ctx, conf, map)) {
+		return;
+	}
+	bench_samples(conf, cx, cy);
+
+	start = now_ns();
+	do {
+		orbit_trace(&ctx, conf->kernel, cx, cy, BENCH_BLOCK, 1);
+		ops += BENCH_BLOCK;
+	} while(now_ns() - start < BENCH_MIN_NS);
+	report("trace", conf, ops, now_ns() - start, "sample");
+
+	orbit_ctx_cleanup(&ctx);
+}
+
+/* Scattering the escaping orbits of a block of samples into the map (replaying the orbit included) */
+static void
+bench_scatter(config_t* conf, uint32_t* map) {
+	orbit_ctx_t ctx;
+	double      cx[BENCH_BLOCK], cy[BENCH_BLOCK];
+	int         escape[BENCH_BLOCK];
+	uint64_t    start, points;
+	int         i, l;
+
+	if(!orbit_ctx_init(&ctx, conf, map)) {
+		return;
+	}
+	bench_samples(conf, cx, cy);
+	orbit_escape(&ctx, conf->kernel, cx, cy, BENCH_BLOCK, escape);
+
+	start = now_ns();
+	do {
+		for(i = 0; i < BENCH_BLOCK; i++) {
+			if(escape[i] >= 0) {
+				orbit_scatter(&ctx, cx[i], cy[i], escape[i], 1);
+			}
+		}
+	} while(now_ns() - start < BENCH_MIN_NS);
+
+	for(points = 0, l = 0; l < conf->iters_n; l++) {
+		points += ctx.deposited[l];
+	}
+	report("scatter", conf, points, now_ns() - start, "point");
+
+	orbit_ctx_cleanup(&ctx);
+}
+
+/* render() (which adds the layers up, so every run gets a fresh copy of the map) */
+static void
+bench_render(config_t* conf, uint32_t* map, uint32_t* copy) {
+	uint64_t start, ns = 0, ops = 0;
+	size_t   n = bench_mapsize(conf);
+
+	do {
+		memcpy(copy, map, sizeof(uint32_t) * n);
+		start = now_ns();
+		if(!render(conf, copy)) {
+			return;
+		}
+		ns  += now_ns() - start;
+		ops += (uint64_t) conf->width * conf->height;
+	} while(ns < BENCH_MIN_NS);
+	report("render", conf, ops, ns, "pixel");
+}
+
+static void
+bench_bmp(config_t* conf) {
+	bmp_write_handle_t* bmph;
+	color_t             col;
+	uint64_t            start, ops = 0;
+	int                 i, pixels = conf->width * conf->height;
+
+	start = now_ns();
+	do {
+		if(!(bmph = bmp_create(conf->output, conf->width, conf->height))) {
+			return;
+		}
+		for(i = 0; i < pixels; i++) {
+			col.r = i & 0xff;
+			col.g = (i >> 8) & 0xff;
+			col.b = (i >> 16) & 0xff;
+			if(!bmp_write_pixel(bmph, col)) {
+				bmp_destroy(bmph);
+				return;
+			}
+		}
+		bmp_destroy(bmph);
+		ops += pixels;
+	} while(now_ns() - start < BENCH_MIN_NS);
+	report("bmp_write_pixel", conf, ops, now_ns() - start, "pixel");
+}
+
+/* Saving and loading the statefile (raw or compressed), an op is a byte of the map */
+static void
+bench_state(config_t* conf, uint32_t* map, int compress) {
+	uint64_t start, ops;
+	uint64_t bytes = sizeof(uint32_t) * bench_mapsize(conf);
+	uint64_t samples;
+
+	conf->compress = compress;
+
+	start = now_ns();
+	ops   = 0;
+	do {
+		if(!state_save(conf, map, 1)) {
+			return;
+		}
+		ops += bytes;
+	} while(now_ns() - start < BENCH_MIN_NS);
+	report(compress ? "state_save_varint" : "state_save", conf, ops, now_ns() - start, "byte");
+
+	start = now_ns();
+	ops   = 0;
+	do {
+		if(!state_load(conf, map, &samples)) {
+			return;
+		}
+		ops += bytes;
+	} while(now_ns() - start < BENCH_MIN_NS);
+	report(compress ? "state_load_varint" : "state_load", conf, ops, now_ns() - start, "byte");
+}
+
+int
+main(void) {
+	int       rv = 1;
+	size_t    s, i;
+	config_t  conf;
+	uint32_t* map  = NULL;
+	uint32_t* copy = NULL;
+
+	puts("name\twidth\theight\titers\tops\tns_per_op\tops_per_s\top");
+
+	for(i = 0; i < N_ITERS; i++) {
+		bench_conf(&conf, bench_sizes, bench_iters + i);
+		bench_kernel(&conf, KERNEL_SIMD, "kernel_simd");
+		bench_kernel(&conf, KERNEL_SCALAR, "kernel_scalar");
+
+		for(s = 0; s < N_SIZES; s++) {
+			bench_conf(&conf, bench_sizes + s, bench_iters + i);
+			if(
+			        !(map = malloc(sizeof(uint32_t) * bench_mapsize(&conf))) ||
+			        !(copy = calloc(bench_mapsize(&conf), sizeof(uint32_t)))) {
+				fputs("Could not allocate memory for map.\n", stderr);
+				goto tidyup;
+			}
+
+			bench_trace(&conf, copy);
+			bench_scatter(&conf, copy);
+			bench_map(&conf, map);
+			bench_render(&conf, map, copy);
+			bench_bmp(&conf);
+			bench_state(&conf, map, 0);
+			bench_state(&conf, map, 1);
+
+			free(map);
+			free(copy);
+			map  = NULL;
+			copy = NULL;
+		}
+	}
+	rv = 0;
+
+tidyup:
+	free(map);
+	free(copy);
+	remove(BENCH_STATEFILE);
+	remove(BENCH_OUTPUT);
+	return rv;
+}
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include "config.h"
 #include "color.h"
@@ -15,6 +17,12 @@ conf_destroy(config_t* conf) {
 	if(conf->colors) {
 		free(conf->colors);
 	}
+	if(conf->metrics) {
+		free(conf->metrics);
+	}
+	if(conf->reference) {
+		free(conf->reference);
+	}
 	free(conf);
 }
 
@@ -76,6 +84,42 @@ conf_get_int(dictionary* ini, char* key, int* val) {
 	return 1;
 }
 
+/* Get an optional int value that is >= min. If it is missing, def is used. */
+static int
+conf_get_optional_int(dictionary* ini, char* key, int def, int min, int* val) {
+	if(!iniparser_find_entry(ini, key)) {
+		*val = def;
+		return 1;
+	}
+
+	*val = iniparser_getint(ini, key, min - 1);
+
+	if(*val < min) {
+		fprintf(stderr, "Value for key '%s' is invalid.\n", key);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Get an optional double value that must be > 0. If it is missing, def is used. */
+static int
+conf_get_optional_double(dictionary* ini, char* key, double def, double* val) {
+	if(!iniparser_find_entry(ini, key)) {
+		*val = def;
+		return 1;
+	}
+
+	*val = iniparser_getdouble(ini, key, -1.0);
+
+	if(!(*val > 0)) {
+		fprintf(stderr, "Value for key '%s' is invalid.\n", key);
+		return 0;
+	}
+
+	return 1;
+}
+
 static char*
 conf_get_string(dictionary* ini, char* key, char* def) {
 	char*  _s;
@@ -92,6 +136,65 @@ conf_get_string(dictionary* ini, char* key, char* def) {
 	return strcpy(s, _s);
 }
 
+/* Get an optional config value that must be one of choices (a NULL terminated list). */
+static int
+conf_get_choice(dictionary* ini, char* key, const char** choices, int def, int* val) {
+	int   i;
+	char* s;
+
+	if(!iniparser_find_entry(ini, key)) {
+		*val = def;
+		return 1;
+	}
+
+	s = iniparser_getstring(ini, key, "");
+	for(i = 0; choices[i]; i++) {
+		if(strcmp(s, choices[i]) == 0) {
+			*val = i;
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "Value for key '%s' is invalid.\n", key);
+	return 0;
+}
+
+static const char* kernel_names[]    = { "simd", "scalar", NULL };
+static const char* precision_names[] = { "double", "float", "mixed", NULL };
+static const char* sampler_names[]   = { "uniform", "mh", "sobol", NULL };
+static const char* symmetry_names[]  = { "off", "mirror", "fold", NULL };
+static const char* rng_names[]       = { "sfmt", "philox", NULL };
+
+/* Get the optional seed. If it is missing, a random one is read from /dev/urandom. */
+static int
+conf_get_seed(dictionary* ini, char* key, uint64_t* val) {
+	char* s;
+	char* endptr;
+	FILE* fh;
+
+	if(iniparser_find_entry(ini, key)) {
+		s    = iniparser_getstring(ini, key, "");
+		*val = strtoull(s, &endptr, 0);
+		if((*s == '\0') || (*endptr != '\0')) {
+			fprintf(stderr, "Value for key '%s' is invalid.\n", key);
+			return 0;
+		}
+		return 1;
+	}
+
+	if(!(fh = fopen("/dev/urandom", "rb"))) {
+		fputs("Could not open /dev/urandom.\n", stderr);
+		return 0;
+	}
+	if(fread(val, sizeof(uint64_t), 1, fh) != 1) {
+		fputs("Could not read a seed from /dev/urandom.\n", stderr);
+		fclose(fh);
+		return 0;
+	}
+	fclose(fh);
+	return 1;
+}
+
 int
 conf_load(char* path, config_t** conf) {
 	int         i;
@@ -108,6 +211,8 @@ conf_load(char* path, config_t** conf) {
 	(*conf)->colors    = NULL;
 	(*conf)->statefile = NULL;
 	(*conf)->output    = NULL;
+	(*conf)->metrics   = NULL;
+	(*conf)->reference = NULL;
 
 	if(!(ini = iniparser_load(path))) {
 		fputs("Could not parse ini file.\n", stderr);
@@ -119,7 +224,7 @@ conf_load(char* path, config_t** conf) {
 	        (!conf_get_int(ini, "nebula2:height", &((*conf)->height))) ||
 	        (!conf_get_int(ini, "nebula2:jobsize", &((*conf)->jobsize))) ||
 	        (!conf_get_int(ini, "nebula2:jobs", &((*conf)->jobs))) ||
-	        (!conf_get_int(ini, "nebula2:threads", &((*conf)->threads)))) {
+	        (!conf_get_optional_int(ini, "nebula2:threads", 0, 0, &((*conf)->threads)))) {
 		goto failed;
 	}
 
@@ -130,6 +235,26 @@ conf_load(char* path, config_t** conf) {
 		goto failed;
 	}
 
+	if(
+	        (!conf_get_choice(ini, "nebula2:kernel", kernel_names, KERNEL_SIMD, &((*conf)->kernel))) ||
+	        (!conf_get_choice(ini, "nebula2:symmetry", symmetry_names, SYMMETRY_OFF, &((*conf)->symmetry))) ||
+	        (!conf_get_choice(ini, "nebula2:precision", precision_names, PRECISION_DOUBLE, &((*conf)->precision))) ||
+	        (!conf_get_optional_int(ini, "nebula2:bulbtest", 1, 0, &((*conf)->bulbtest))) ||
+	        (!conf_get_optional_int(ini, "nebula2:twophase", 0, 0, &((*conf)->twophase))) ||
+	        (!conf_get_optional_int(ini, "nebula2:jobtime", 100, 0, &((*conf)->jobtime))) ||
+	        (!conf_get_optional_int(ini, "nebula2:numa", 0, 0, &((*conf)->numa))) ||
+	        (!conf_get_optional_int(ini, "nebula2:shards", 0, 0, &((*conf)->shards))) ||
+	        (!conf_get_optional_int(ini, "nebula2:shardmerge", 64, 1, &((*conf)->shardmerge))) ||
+	        (!conf_get_optional_int(ini, "nebula2:periodcheck", 16, 0, &((*conf)->periodcheck))) ||
+	        (!conf_get_optional_double(ini, "nebula2:periodeps", 1e-12, &((*conf)->periodeps)))) {
+		goto failed;
+	}
+	/* The columns x and width-1-x are only mirror images, if the width is even. */
+	if(((*conf)->symmetry != SYMMETRY_OFF) && ((*conf)->width % 2 != 0)) {
+		fputs("symmetry needs an even width.\n", stderr);
+		goto failed;
+	}
+
 	for((*conf)->iters_n = 0;; ((*conf)->iters_n)++) {
 		if(snprintf(namebuf, NAMEBUF_SIZE, "nebula2:iter%d", (*conf)->iters_n) < 0) {
 			fputs("Error while counting iterX values.\n", stderr);
@@ -181,6 +306,74 @@ conf_load(char* path, config_t** conf) {
 		}
 	}
 
+	if(
+	        (!conf_get_choice(ini, "nebula2:sampler", sampler_names, SAMPLER_UNIFORM, &((*conf)->sampler))) ||
+	        (!conf_get_optional_int(ini, "nebula2:mhlayer", (*conf)->iters_n - 1, 0, &((*conf)->mhlayer))) ||
+	        (!conf_get_optional_int(ini, "nebula2:mhboost", 16, 1, &((*conf)->mhboost)))) {
+		goto failed;
+	}
+	if((*conf)->mhlayer >= (*conf)->iters_n) {
+		fputs("mhlayer must be the index of a layer.\n", stderr);
+		goto failed;
+	}
+
+	if(
+	        (!conf_get_optional_int(ini, "nebula2:mask", 0, 0, &((*conf)->mask))) ||
+	        (!conf_get_optional_int(ini, "nebula2:maskres", 256, 1, &((*conf)->maskres))) ||
+	        (!conf_get_optional_int(ini, "nebula2:maskweight", 16, 1, &((*conf)->maskweight)))) {
+		goto failed;
+	}
+	if((*conf)->mask && ((*conf)->sampler != SAMPLER_UNIFORM)) {
+		fputs("The rejection mask can only be used with the uniform sampler.\n", stderr);
+		goto failed;
+	}
+
+	if(
+	        (!conf_get_choice(ini, "nebula2:rng", rng_names, RNG_SFMT, &((*conf)->rng))) ||
+	        (!conf_get_seed(ini, "nebula2:seed", &((*conf)->seed)))) {
+		goto failed;
+	}
+	if(
+	        (!conf_get_optional_int(ini, "nebula2:convcheck", 0, 0, &((*conf)->convcheck))) ||
+	        (!conf_get_optional_double(ini, "nebula2:quality", 0, &((*conf)->quality)))) {
+		goto failed;
+	}
+	if(
+	        (!conf_get_optional_int(ini, "nebula2:progress", 0, 0, &((*conf)->progress))) ||
+	        (!conf_get_optional_int(ini, "nebula2:metricsinterval", 10, 1, &((*conf)->metricsinterval))) ||
+	        (!conf_get_optional_int(ini, "nebula2:checkpoint", 0, 0, &((*conf)->checkpoint))) ||
+	        (!conf_get_optional_int(ini, "nebula2:mmap", 0, 0, &((*conf)->mmap))) ||
+	        (!conf_get_optional_int(ini, "nebula2:verify", 0, 0, &((*conf)->verify))) ||
+	        (!conf_get_optional_int(ini, "nebula2:compress", 0, 0, &((*conf)->compress)))) {
+		goto failed;
+	}
+	if(!((*conf)->metrics = conf_get_string(ini, "nebula2:metrics", ""))) {
+		goto failed;
+	}
+
+	if(
+	        (!conf_get_optional_int(ini, "nebula2:checksum", 0, 0, &((*conf)->checksum))) ||
+	        (!conf_get_optional_double(ini, "nebula2:reftolerance", 0, &((*conf)->reftolerance)))) {
+		goto failed;
+	}
+	if(!((*conf)->reference = conf_get_string(ini, "nebula2:reference", ""))) {
+		goto failed;
+	}
+	if((*conf)->mmap && (*conf)->compress) {
+		fputs("A memory mapped statefile can't be compressed.\n", stderr);
+		goto failed;
+	}
+	if(((*conf)->quality > 0) && ((*conf)->convcheck == 0)) {
+		fputs("quality needs the noise estimation (convcheck).\n", stderr);
+		goto failed;
+	}
+
+	/* The MH chains live as long as their thread, so they can't be reproduced per sample. */
+	if(((*conf)->rng == RNG_PHILOX) && ((*conf)->sampler != SAMPLER_UNIFORM)) {
+		fputs("rng=philox can only be used with the uniform sampler.\n", stderr);
+		goto failed;
+	}
+
 	iniparser_freedict(ini);
 	return 1;
 
@@ -205,11 +398,48 @@ conf_print(config_t* conf) {
 	printf("jobsize: %d\n",   conf->jobsize);
 	printf("jobs: %d\n",      conf->jobs);
 	printf("threads: %d\n",     conf->threads);
+	printf("jobtime: %d\n",   conf->jobtime);
+	printf("numa: %d\n",      conf->numa);
 	printf("statefile: %s\n", conf->statefile);
 	printf("output: %s\n",    conf->output);
+	printf("kernel: %s\n",    kernel_names[conf->kernel]);
+	printf("symmetry: %s\n",  symmetry_names[conf->symmetry]);
+	printf("shards: %d\n",    conf->shards);
+	printf("shardmerge: %d\n", conf->shardmerge);
+	printf("rng: %s\n",       rng_names[conf->rng]);
+	printf("seed: %" PRIu64 "\n", conf->seed);
+	printf("convcheck: %d\n", conf->convcheck);
+	printf("quality: %g\n",   conf->quality);
+	printf("progress: %d\n",  conf->progress);
+	printf("metrics: %s\n",   conf->metrics);
+	printf("metricsinterval: %d\n", conf->metricsinterval);
+	printf("checkpoint: %d\n", conf->checkpoint);
+	printf("mmap: %d\n",     conf->mmap);
+	printf("verify: %d\n",   conf->verify);
+	printf("compress: %d\n", conf->compress);
+	printf("checksum: %d\n",  conf->checksum);
+	printf("reference: %s\n", conf->reference);
+	printf("reftolerance: %g\n", conf->reftolerance);
+	printf("bulbtest: %d\n",  conf->bulbtest);
+	printf("twophase: %d\n",  conf->twophase);
+	printf("precision: %s\n", precision_names[conf->precision]);
+	printf("periodcheck: %d\n", conf->periodcheck);
+	printf("periodeps: %g\n", conf->periodeps);
+
+	printf("sampler: %s\n",   sampler_names[conf->sampler]);
+	printf("mhlayer: %d\n",   conf->mhlayer);
+	printf("mhboost: %d\n",   conf->mhboost);
+	printf("mask: %d\n",      conf->mask);
+	printf("maskres: %d\n",   conf->maskres);
+	printf("maskweight: %d\n", conf->maskweight);
 
 	for(i = 0; i < conf->iters_n; i++) {
 		col = conf->colors[i];
 		printf("Iteration %d: %d, %02x%02x%02x\n", i, conf->iters[i], col.r, col.g, col.b);
 	}
 }
+
+int
+conf_map_width(config_t* conf) {
+	return (conf->symmetry == SYMMETRY_FOLD) ? conf->width / 2 : conf->width;
+}
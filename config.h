@@ -1,11 +1,39 @@
 #ifndef _nebula2_config_h_
 #define _nebula2_config_h_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "color.h"
 
+/* Orbit kernels */
+#define KERNEL_SIMD   0
+#define KERNEL_SCALAR 1
+
+/* Precision policies */
+#define PRECISION_DOUBLE 0 /* Everything in double precision */
+#define PRECISION_FLOAT  1 /* Float prefilter, only escaping orbits are checked in double precision */
+#define PRECISION_MIXED  2 /* Like PRECISION_FLOAT, orbits that weren't proven to be bounded are checked, too */
+
+/* Samplers for c */
+#define SAMPLER_UNIFORM 0
+#define SAMPLER_MH      1
+#define SAMPLER_SOBOL   2
+
+/* Random number generators */
+#define RNG_SFMT   0 /* Seeded from /dev/urandom per thread */
+#define RNG_PHILOX 1 /* Counter based, the random numbers of a sample only depend on seed and its index */
+
+/* Symmetry modes (the Buddhabrot is symmetric under complex conjugation) */
+#define SYMMETRY_OFF    0
+#define SYMMETRY_MIRROR 1 /* Sample half of c-space, every deposit is mirrored */
+#define SYMMETRY_FOLD   2 /* Sample half of c-space, only the left half of the map is stored */
+
 typedef struct {
 	int width, height;
 	int jobsize, jobs, threads;
+	int jobtime;
+	int numa;
 
 	char* statefile;
 	char* output;
@@ -13,10 +41,64 @@ typedef struct {
 	int      iters_n;
 	int*     iters;
 	color_t* colors;
+
+	int    kernel;
+	int    bulbtest;
+	int    twophase;
+	int    precision;
+	int    periodcheck;
+	double periodeps;
+
+	int sampler;
+	int mhlayer, mhboost;
+
+	int mask, maskres, maskweight;
+
+	int symmetry;
+
+	int shards, shardmerge;
+
+	int      rng;
+	uint64_t seed;
+
+	int    convcheck;
+	double quality;
+
+	int progress;
+
+	char* metrics;
+	int   metricsinterval;
+
+	int checkpoint;
+	int mmap;
+	int verify;
+	int compress;
+
+	int    checksum;
+	char*  reference;
+	double reftolerance;
 } config_t;
 
 extern void conf_destroy(config_t* conf);
 extern int conf_load(char* path, config_t** conf);
 extern void conf_print(config_t* conf);
 
+/* Number of map columns that are stored (only the left half with symmetry=fold). */
+extern int conf_map_width(config_t* conf);
+
+/* Map index of pixel i. A folded map only has the left half, the right half is its mirror image. */
+inline static size_t
+conf_map_index(config_t* conf, size_t i) {
+	size_t x, y, w;
+
+	if(conf->symmetry != SYMMETRY_FOLD) {
+		return i;
+	}
+
+	w = conf->width;
+	x = i % w;
+	y = i / w;
+	return y * (w / 2) + ((x < w / 2) ? x : w - 1 - x);
+}
+
 #endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "config.h"
+#include "convergence.h"
+
+conv_t*
+conv_create(config_t* conf) {
+	conv_t* conv;
+
+	if(!(conv = malloc(sizeof(conv_t)))) {
+		return NULL;
+	}
+
+	conv->layers       = conf->iters_n;
+	conv->layersize    = (size_t) conf_map_width(conf) * conf->height;
+	conv->prev_samples = 0;
+	conv->samples      = 0;
+
+	conv->cur   = malloc(sizeof(uint32_t) * conv->layersize * conv->layers);
+	conv->prev  = malloc(sizeof(uint32_t) * conv->layersize * conv->layers);
+	conv->noise = malloc(sizeof(double) * conv->layers);
+	if(!conv->cur || !conv->prev || !conv->noise) {
+		conv_destroy(conv);
+		return NULL;
+	}
+
+	return conv;
+}
+
+void
+conv_destroy(conv_t* conv) {
+	free(conv->cur);
+	free(conv->prev);
+	free(conv->noise);
+	free(conv);
+}
+
+/* L1 distance of the normalized histograms a and b */
+static double
+distance(uint32_t* a, uint32_t* b, size_t n) {
+	size_t i;
+	double sa = 0, sb = 0, d = 0;
+
+	for(i = 0; i < n; i++) {
+		sa += a[i];
+		sb += b[i];
+	}
+	if((sa == 0) || (sb == 0)) {
+		return (sa == sb) ? 0 : 2;
+	}
+
+	for(i = 0; i < n; i++) {
+		d += fabs(a[i] / sa - b[i] / sb);
+	}
+	return d;
+}
+
+void
+conv_update(conv_t* conv, uint32_t* map, uint32_t** replicas, int replicas_n, uint64_t samples) {
+	int       i, l;
+	size_t    k;
+	size_t    size = conv->layersize * conv->layers;
+	uint32_t* tmp;
+
+	/* Without new samples, the distance would be 0 and tell us nothing. */
+	if(conv->prev_samples && (samples <= conv->prev_samples)) {
+		return;
+	}
+
+	memcpy(conv->cur, map, sizeof(uint32_t) * size);
+	for(i = 0; i < replicas_n; i++) {
+		for(k = 0; k < size; k++) {
+			conv->cur[k] += replicas[i][k];
+		}
+	}
+
+	if(conv->prev_samples) {
+		for(l = 0; l < conv->layers; l++) {
+			conv->noise[l] = distance(conv->cur + l * conv->layersize, conv->prev + l * conv->layersize, conv->layersize) *
+			                 sqrt((double) conv->prev_samples / (samples - conv->prev_samples));
+		}
+		conv->samples = samples;
+	}
+
+	tmp                = conv->prev;
+	conv->prev         = conv->cur;
+	conv->cur          = tmp;
+	conv->prev_samples = samples;
+}
+
+int
+conv_done(conv_t* conv, double quality) {
+	int l;
+
+	if(!conv->samples) {
+		return 0;
+	}
+	for(l = 0; l < conv->layers; l++) {
+		if(conv->noise[l] > quality) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+uint64_t
+conv_samples_needed(conv_t* conv, double quality) {
+	int    l;
+	double f, max = 1.0;
+
+	/* The noise decreases with 1 / sqrt(samples). */
+	for(l = 0; l < conv->layers; l++) {
+		f = conv->noise[l] / quality;
+		if(f * f > max) {
+			max = f * f;
+		}
+	}
+	return (uint64_t) (conv->samples * (max - 1.0));
+}
+
+void
+conv_print(conv_t* conv, double quality, int jobsize) {
+	int l;
+
+	if(!conv->samples) {
+		puts("Noise estimate: not enough data yet");
+		return;
+	}
+
+	fputs("Noise estimate:", stdout);
+	for(l = 0; l < conv->layers; l++) {
+		printf(" %.4f", conv->noise[l]);
+	}
+	putchar('\n');
+
+	if(quality > 0) {
+		printf("About %" PRIu64 " more jobs needed for quality %g\n", (conv_samples_needed(conv, quality) + jobsize - 1) / jobsize, quality);
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef _nebula2_convergence_h_
+#define _nebula2_convergence_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Noise estimation: Two snapshots of the map, taken after n1 and n2 samples, differ only by the
+ * noise of the samples in between. For the normalized histogram of a layer, the expected L1
+ * distance d of the snapshots is e(n1) * sqrt(1 - n1 / n2), where e(n) ~ 1 / sqrt(n) is the L1
+ * distance to the exact histogram. So the noise after n2 samples is e(n2) = d * sqrt(n1 / (n2 - n1)).
+ */
+typedef struct {
+	int    layers;
+	size_t layersize;
+
+	uint32_t* cur;
+	uint32_t* prev;
+	uint64_t  prev_samples; /* 0: no snapshot yet */
+
+	uint64_t samples; /* Samples of the last estimate (0: none yet) */
+	double*  noise;   /* Estimated L1 noise of every layer */
+} conv_t;
+
+extern conv_t* conv_create(config_t* conf);
+extern void conv_destroy(conv_t* conv);
+
+/* Take a snapshot of the map plus its replicas (see numa), which contain the given number of samples. */
+extern void conv_update(conv_t* conv, uint32_t* map, uint32_t** replicas, int replicas_n, uint64_t samples);
+
+/* Was the quality target reached by every layer? */
+extern int conv_done(conv_t* conv, double quality);
+
+/* Estimated number of additional samples until every layer reaches the quality target */
+extern uint64_t conv_samples_needed(conv_t* conv, double quality);
+
+/* Print the last estimate (and the jobs still needed, if quality > 0). */
+extern void conv_print(conv_t* conv, double quality, int jobsize);
+
+#endif
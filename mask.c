@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "orbit.h"
+#include "mask.h"
+
+/* Probe orbits per cell edge. Neighbouring cells share the probes on their common edge. */
+#define MASK_PROBES 4
+
+/* Header of a mask file: magic, version and everything the classification depends on. */
+#define MASK_MAGIC   0x6b73616d /* "mask" */
+#define MASK_VERSION 1
+#define MASK_HEADER  8
+
+/* Probe flags, a cell is classified by the flags of all its probes. */
+#define PROBE_SLOW    1
+#define PROBE_FAST    2
+#define PROBE_BOUNDED 4
+
+static void
+mask_header(config_t* conf, uint32_t* header) {
+	header[0] = MASK_MAGIC;
+	header[1] = MASK_VERSION;
+	header[2] = conf->maskres;
+	header[3] = conf->maskres;
+	header[4] = conf->width;
+	header[5] = conf->height;
+	header[6] = conf->iters[0];
+	header[7] = conf->iters[conf->iters_n - 1];
+}
+
+static char*
+mask_path(config_t* conf) {
+	char* path;
+
+	if(!(path = malloc(strlen(conf->statefile) + sizeof(".mask")))) {
+		return NULL;
+	}
+	strcpy(path, conf->statefile);
+	return strcat(path, ".mask");
+}
+
+/* Read the cells from path. Returns 0, if the file is missing or doesn't match the config. */
+static int
+mask_read(config_t* conf, char* path, mask_t* mask) {
+	FILE*    fh;
+	uint32_t header[MASK_HEADER];
+	uint32_t expected[MASK_HEADER];
+	size_t   n = (size_t) mask->cells_x * mask->cells_y;
+	int      ok;
+
+	if(!(fh = fopen(path, "rb"))) {
+		return 0;
+	}
+
+	mask_header(conf, expected);
+	ok = (fread(header, sizeof(uint32_t), MASK_HEADER, fh) == MASK_HEADER) &&
+	     (memcmp(header, expected, sizeof(header)) == 0) &&
+	     (fread(mask->cells, 1, n, fh) == n);
+
+	fclose(fh);
+	return ok;
+}
+
+static int
+mask_write(config_t* conf, char* path, mask_t* mask) {
+	FILE*    fh;
+	uint32_t header[MASK_HEADER];
+	size_t   n = (size_t) mask->cells_x * mask->cells_y;
+	int      errsv;
+
+	if(!(fh = fopen(path, "wb"))) {
+		return 0;
+	}
+
+	mask_header(conf, header);
+	if(
+	        (fwrite(header, sizeof(uint32_t), MASK_HEADER, fh) != MASK_HEADER) ||
+	        (fwrite(mask->cells, 1, n, fh) != n)) {
+		errsv = errno;
+		fclose(fh);
+		errno = errsv;
+		return 0;
+	}
+
+	fclose(fh);
+	return 1;
+}
+
+/*
+ * The pre-pass: iterate a grid of probe orbits and classify every cell by its probes. Since the
+ * Mandelbrot set is connected, a cell whose probes are all bounded is (most likely) interior. To be
+ * safe, such cells stay interior only if all their neighbours are, too.
+ */
+static int
+mask_build(config_t* conf, mask_t* mask) {
+	orbit_ctx_t ctx;
+	int         px = mask->cells_x * MASK_PROBES + 1;
+	int         py = mask->cells_y * MASK_PROBES + 1;
+	double*     cx = NULL;
+	double*     cy = NULL;
+	int*        escape = NULL;
+	uint8_t*    flags  = NULL;
+	int         rv = 0;
+	int         i, j, k, r, di, dj, ni, nj;
+	uint8_t     f;
+
+	ctx.pointlist = NULL;
+	ctx.escaped   = NULL;
+	if(!orbit_ctx_init(&ctx, conf, NULL)) {
+		goto tidyup;
+	}
+
+	if(
+	        !(cx = malloc(sizeof(double) * px)) ||
+	        !(cy = malloc(sizeof(double) * px)) ||
+	        !(escape = malloc(sizeof(int) * px)) ||
+	        !(flags = calloc((size_t) mask->cells_x * mask->cells_y, 1))) {
+		goto tidyup;
+	}
+
+	for(r = 0; r < py; r++) {
+		for(k = 0; k < px; k++) {
+			cx[k] = mask->x0 + k * mask->cell_w / MASK_PROBES;
+			cy[k] = mask->y0 + r * mask->cell_h / MASK_PROBES;
+		}
+		orbit_escape(&ctx, conf->kernel, cx, cy, px, escape);
+
+		for(k = 0; k < px; k++) {
+			if(escape[k] < 0) {
+				f = PROBE_BOUNDED;
+			} else if(escape[k] <= conf->iters[0]) {
+				f = PROBE_FAST;
+			} else {
+				f = PROBE_SLOW;
+			}
+
+			/* Probes on a cell border belong to both cells. */
+			for(j = (r - 1) / MASK_PROBES; j <= r / MASK_PROBES; j++) {
+				for(i = (k - 1) / MASK_PROBES; i <= k / MASK_PROBES; i++) {
+					if((i >= 0) && (j >= 0) && (i < mask->cells_x) && (j < mask->cells_y)) {
+						flags[j * mask->cells_x + i] |= f;
+					}
+				}
+			}
+		}
+	}
+
+	for(j = 0; j < mask->cells_y; j++) {
+		for(i = 0; i < mask->cells_x; i++) {
+			f = flags[j * mask->cells_x + i];
+			if(f == PROBE_FAST) {
+				mask->cells[j * mask->cells_x + i] = MASK_FAST;
+				continue;
+			}
+
+			mask->cells[j * mask->cells_x + i] = MASK_INTERESTING;
+			if(f != PROBE_BOUNDED) {
+				continue;
+			}
+
+			mask->cells[j * mask->cells_x + i] = MASK_INTERIOR;
+			for(dj = -1; dj <= 1; dj++) {
+				for(di = -1; di <= 1; di++) {
+					ni = i + di;
+					nj = j + dj;
+					if((ni >= 0) && (nj >= 0) && (ni < mask->cells_x) && (nj < mask->cells_y) && (flags[nj * mask->cells_x + ni] != PROBE_BOUNDED)) {
+						mask->cells[j * mask->cells_x + i] = MASK_INTERESTING;
+					}
+				}
+			}
+		}
+	}
+
+	rv = 1;
+tidyup:
+	orbit_ctx_cleanup(&ctx);
+	free(cx);
+	free(cy);
+	free(escape);
+	free(flags);
+	return rv;
+}
+
+/* Collect the cells to draw from and the probability of drawing an interesting one. */
+static int
+mask_index_cells(mask_t* mask) {
+	size_t n = (size_t) mask->cells_x * mask->cells_y;
+	size_t i;
+
+	if(
+	        !(mask->interesting = malloc(sizeof(uint32_t) * n)) ||
+	        !(mask->fast = malloc(sizeof(uint32_t) * n))) {
+		return 0;
+	}
+
+	for(i = 0; i < n; i++) {
+		if(mask->cells[i] == MASK_INTERESTING) {
+			mask->interesting[(mask->n_interesting)++] = i;
+		} else if(mask->cells[i] == MASK_FAST) {
+			mask->fast[(mask->n_fast)++] = i;
+		}
+	}
+
+	if((mask->n_interesting + mask->n_fast) == 0) {
+		return 0;
+	}
+
+	mask->p_interesting = (double) mask->weight * mask->n_interesting / ((double) mask->weight * mask->n_interesting + mask->n_fast);
+	return 1;
+}
+
+mask_t*
+mask_load(config_t* conf) {
+	mask_t* mask;
+	char*   path = NULL;
+	double  conv, mult_x, mult_y;
+	int     hw, hh;
+
+	if(!(mask = malloc(sizeof(mask_t)))) {
+		return NULL;
+	}
+
+	mask->cells_x       = conf->maskres;
+	mask->cells_y       = conf->maskres;
+	mask->weight        = conf->maskweight;
+	mask->interesting   = NULL;
+	mask->fast          = NULL;
+	mask->n_interesting = 0;
+	mask->n_fast        = 0;
+
+	/* The same rectangle random_to_c() samples */
+	precalc_nebula_params(conf, &conv, &mult_x, &mult_y, &hw, &hh);
+	mask->x0     = -mult_x * (UINT32_MAX / 2.0);
+	mask->y0     = -mult_y * (UINT32_MAX / 2.0);
+	mask->cell_w = -2.0 * mask->x0 / mask->cells_x;
+	mask->cell_h = -2.0 * mask->y0 / mask->cells_y;
+
+	if(!(mask->cells = malloc((size_t) mask->cells_x * mask->cells_y))) {
+		goto failed;
+	}
+
+	if(!(path = mask_path(conf))) {
+		goto failed;
+	}
+
+	if(!mask_read(conf, path, mask)) {
+		puts("Building rejection mask...");
+		if(!mask_build(conf, mask)) {
+			fputs("Could not build rejection mask.\n", stderr);
+			goto failed;
+		}
+		if(!mask_write(conf, path, mask)) {
+			fprintf(stderr, "Could not save rejection mask: %s\n", strerror(errno));
+			goto failed;
+		}
+	}
+
+	if(!mask_index_cells(mask)) {
+		fputs("Rejection mask has no cells to sample.\n", stderr);
+		goto failed;
+	}
+
+	printf("Rejection mask: %zu interesting, %zu fast, %zu interior cells\n", mask->n_interesting, mask->n_fast,
+	       (size_t) mask->cells_x * mask->cells_y - mask->n_interesting - mask->n_fast);
+
+	free(path);
+	return mask;
+
+failed:
+	free(path);
+	mask_destroy(mask);
+	return NULL;
+}
+
+void
+mask_destroy(mask_t* mask) {
+	free(mask->cells);
+	free(mask->interesting);
+	free(mask->fast);
+	free(mask);
+}
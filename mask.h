@@ -0,0 +1,69 @@
+#ifndef _nebula2_mask_h_
+#define _nebula2_mask_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Cell classes */
+#define MASK_INTERESTING 0
+#define MASK_FAST        1 /* All orbits escape in the first layer. */
+#define MASK_INTERIOR    2 /* No orbit escapes, the cell is never sampled. */
+
+/*
+ * Rejection mask: a coarse grid over the sampled rectangle. Interesting cells are drawn weight
+ * times more often than fast cells, so deposits from fast cells count weight times, to keep the
+ * histogram unbiased (up to a global factor).
+ */
+typedef struct {
+	int      cells_x, cells_y;
+	uint8_t* cells;
+
+	/* Indices of the cells to draw from */
+	uint32_t* interesting;
+	size_t    n_interesting;
+	uint32_t* fast;
+	size_t    n_fast;
+
+	uint32_t weight;
+	double   p_interesting; /* Probability to draw an interesting cell */
+
+	/* Lower corner of the rectangle and size of a cell */
+	double x0, y0;
+	double cell_w, cell_h;
+} mask_t;
+
+/* Load the mask from <statefile>.mask, or build (and save) it, if it is missing or outdated. */
+extern mask_t* mask_load(config_t* conf);
+extern void mask_destroy(mask_t* mask);
+
+/* Scale u in [0, 1) to an index < n (rounding could give n otherwise). */
+inline static size_t
+mask_index(double u, size_t n) {
+	size_t i = (size_t) (u * n);
+
+	return (i < n) ? i : n - 1;
+}
+
+/* Draw a point c from 128 random bits (r1 chooses the cell). Returns the weight of its deposits. */
+inline static uint32_t
+mask_sample(mask_t* mask, uint64_t r1, uint64_t r2, double* cx, double* cy) {
+	double   u = (r1 >> 11) * (1.0 / 9007199254740992.0);
+	uint64_t r = r2;
+	uint32_t cell, w;
+
+	if(u < mask->p_interesting) {
+		cell = mask->interesting[mask_index(u / mask->p_interesting, mask->n_interesting)];
+		w    = 1;
+	} else {
+		cell = mask->fast[mask_index((u - mask->p_interesting) / (1.0 - mask->p_interesting), mask->n_fast)];
+		w    = mask->weight;
+	}
+
+	*cx = mask->x0 + ((cell % mask->cells_x) + (r >> 32) / 4294967296.0) * mask->cell_w;
+	*cy = mask->y0 + ((cell / mask->cells_x) + (r & UINT32_MAX) / 4294967296.0) * mask->cell_h;
+	return w;
+}
+
+#endif
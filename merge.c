@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "statefile.h"
+#include "merge.h"
+
+/*
+ * Vector primitives for adding up chunks: 8 cells at once with AVX2, 4 with SSE2. There is no
+ * unsigned comparison, so vc_gt compares the cells with the sign bit flipped (see add_cells).
+ */
+#if defined(__AVX2__)
+#define LANES 8
+typedef __m256i vcell;
+#define vc_set1(a)      _mm256_set1_epi32(a)
+#define vc_loadu(p)     _mm256_loadu_si256((const __m256i*) (p))
+#define vc_storeu(p, a) _mm256_storeu_si256((__m256i*) (p), a)
+#define vc_add(a, b)    _mm256_add_epi32(a, b)
+#define vc_xor(a, b)    _mm256_xor_si256(a, b)
+#define vc_or(a, b)     _mm256_or_si256(a, b)
+#define vc_gt(a, b)     _mm256_cmpgt_epi32(a, b)
+#define vc_any(a)       (!_mm256_testz_si256(a, a))
+#elif defined(__SSE2__)
+#define LANES 4
+typedef __m128i vcell;
+#define vc_set1(a)      _mm_set1_epi32(a)
+#define vc_loadu(p)     _mm_loadu_si128((const __m128i*) (p))
+#define vc_storeu(p, a) _mm_storeu_si128((__m128i*) (p), a)
+#define vc_add(a, b)    _mm_add_epi32(a, b)
+#define vc_xor(a, b)    _mm_xor_si128(a, b)
+#define vc_or(a, b)     _mm_or_si128(a, b)
+#define vc_gt(a, b)     _mm_cmpgt_epi32(a, b)
+#define vc_any(a)       (_mm_movemask_epi8(a) != 0)
+#else
+#define LANES 1
+#endif
+
+/* sum += cells (n cells), returns 0 if a cell overflowed (the sum is less than before). */
+static int
+add_cells(uint32_t* sum, const uint32_t* cells, size_t n) {
+	size_t   i    = 0;
+	uint32_t over = 0;
+#if LANES > 1
+	vcell a, s;
+	vcell sign     = vc_set1(INT32_MIN);
+	vcell overflow = vc_set1(0);
+
+	for(; i + LANES <= n; i += LANES) {
+		a        = vc_loadu(sum + i);
+		s        = vc_add(a, vc_loadu(cells + i));
+		overflow = vc_or(overflow, vc_gt(vc_xor(a, sign), vc_xor(s, sign)));
+		vc_storeu(sum + i, s);
+	}
+	over = vc_any(overflow);
+#endif
+	for(; i < n; i++) {
+		over   |= (sum[i] + cells[i] < sum[i]);
+		sum[i] += cells[i];
+	}
+	return !over;
+}
+
+static void
+merge_usage(void) {
+	fputs("Usage: nebula2 merge <output statefile> <statefile>...\n", stderr);
+}
+
+/* Two runs with the same seed calculated the same (indexed) samples, adding them counts them twice. */
+static int
+same_samples(state_header_t* a, state_header_t* b) {
+	return (a->rng == b->rng) && (a->sampler == b->sampler) && (a->seed == b->seed) &&
+	       ((a->rng == RNG_PHILOX) || (a->sampler == SAMPLER_SOBOL));
+}
+
+/*
+ * The inputs must have the same size, iterations, symmetry, sampler and mask as the first one.
+ * They are read and added chunk by chunk, so only a few chunks are in memory at once. The output
+ * gets the encoding and the run settings of the first input and the sum of the samples (exactly,
+ * whatever the jobsizes of the inputs are).
+ */
+int
+merge(int argc, char** argv) {
+	config_t*        conf    = NULL;
+	state_reader_t** readers = NULL;
+	state_writer_t*  writer  = NULL;
+	state_header_t*  hdr;
+	uint32_t*        sum   = NULL;
+	uint32_t*        cells = NULL;
+	uint64_t         samples = 0;
+	uint32_t         c;
+	size_t           n;
+	int              i, j;
+	int              rv     = 1;
+	int              inputs = argc - 1;
+
+	if(argc < 2) {
+		merge_usage();
+		return 1;
+	}
+
+	if(!state_config(argv[1], &conf)) {
+		fprintf(stderr, "Error while reading statefile %s: %s\n", argv[1], strerror(errno));
+		goto tidyup;
+	}
+	if(
+	        !(readers = calloc(inputs, sizeof(state_reader_t*))) ||
+	        !(sum = malloc(sizeof(uint32_t) * STATE_CHUNK)) ||
+	        !(cells = malloc(sizeof(uint32_t) * STATE_CHUNK))) {
+		fputs("Could not allocate memory for merging.\n", stderr);
+		goto tidyup;
+	}
+
+	for(i = 0; i < inputs; i++) {
+		if(!(readers[i] = state_open(conf, argv[i + 1]))) {
+			fprintf(stderr, "Error while reading statefile %s: %s\n", argv[i + 1], strerror(errno));
+			goto tidyup;
+		}
+		hdr = readers[i]->hdr;
+
+		for(j = 0; j < i; j++) {
+			if(state_same(readers[j], readers[i])) {
+				fprintf(stderr, "Statefiles %s and %s are the same file or copies of it, its samples would count twice.\n", argv[j + 1], argv[i + 1]);
+				goto tidyup;
+			}
+			if(same_samples(readers[j]->hdr, hdr)) {
+				fprintf(stderr, "Statefiles %s and %s contain the same samples (same seed), every run needs its own seed.\n", argv[j + 1], argv[i + 1]);
+				goto tidyup;
+			}
+		}
+		samples += hdr->samples;
+	}
+
+	conf->statefile = argv[0];
+	if(!(writer = state_create(conf))) {
+		fprintf(stderr, "Error while creating statefile %s: %s\n", argv[0], strerror(errno));
+		goto tidyup;
+	}
+
+	for(c = 0; c < readers[0]->hdr->chunks_n; c++) {
+		if(!(n = state_read(readers[0], c, sum))) {
+			fprintf(stderr, "Error while reading statefile %s: %s\n", argv[1], strerror(errno));
+			goto tidyup;
+		}
+		for(i = 1; i < inputs; i++) {
+			if(!state_read(readers[i], c, cells)) {
+				fprintf(stderr, "Error while reading statefile %s: %s\n", argv[i + 1], strerror(errno));
+				goto tidyup;
+			}
+			if(!add_cells(sum, cells, n)) {
+				fprintf(stderr, "The sum of chunk %" PRIu32 " overflows, the statefiles can't be merged.\n", c);
+				goto tidyup;
+			}
+		}
+		if(!state_write(writer, sum)) {
+			fprintf(stderr, "Error while writing statefile %s: %s\n", argv[0], strerror(errno));
+			goto tidyup;
+		}
+	}
+
+	rv     = state_commit(writer, samples) ? 0 : 1;
+	writer = NULL;
+	if(rv != 0) {
+		fprintf(stderr, "Error while writing statefile %s: %s\n", argv[0], strerror(errno));
+		goto tidyup;
+	}
+	printf("Merged %d statefiles into %s: %" PRIu64 " samples.\n", inputs, argv[0], samples);
+
+tidyup:
+	if(writer) {
+		state_discard(writer);
+	}
+	for(i = 0; readers && (i < inputs); i++) {
+		if(readers[i]) {
+			state_close(readers[i]);
+		}
+	}
+	free(readers);
+	free(sum);
+	free(cells);
+	if(conf) {
+		conf_destroy(conf);
+	}
+	return rv;
+}
@@ -0,0 +1,10 @@
+#ifndef _nebula2_merge_h_
+#define _nebula2_merge_h_
+
+/*
+ * nebula2 merge <output> <statefile>...: Add up the maps of independent runs (e.g. on several
+ * machines) into one statefile. argv[0] is the output. Returns the exit code.
+ */
+extern int merge(int argc, char** argv);
+
+#endif
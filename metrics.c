@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "stats.h"
+#include "metrics.h"
+
+#define METRICS_TMP_SUFFIX ".tmp"
+#define LABELBUF_SIZE      32
+
+/* statefile="<statefile>", with \, " and newlines escaped */
+static char*
+make_label(const char* statefile) {
+	char*       label;
+	char*       p;
+	const char* prefix = "statefile=\"";
+
+	if(!(label = malloc(strlen(prefix) + 2 * strlen(statefile) + 2))) {
+		return NULL;
+	}
+
+	strcpy(label, prefix);
+	for(p = label + strlen(prefix); *statefile; statefile++) {
+		switch(*statefile) {
+		case '\\':
+		case '"':
+			*(p++) = '\\';
+			*(p++) = *statefile;
+			break;
+		case '\n':
+			*(p++) = '\\';
+			*(p++) = 'n';
+			break;
+		default:
+			*(p++) = *statefile;
+		}
+	}
+	strcpy(p, "\"");
+	return label;
+}
+
+metrics_t*
+metrics_create(config_t* conf, uint64_t map_bytes) {
+	metrics_t* metrics;
+
+	if(!(metrics = malloc(sizeof(metrics_t)))) {
+		return NULL;
+	}
+
+	metrics->tmppath       = NULL;
+	metrics->label         = NULL;
+	metrics->stats.escaped = NULL;
+
+	metrics->path               = conf->metrics;
+	metrics->jobs_done          = 0;
+	metrics->jobs_todo          = 0;
+	metrics->samples_rate       = 0;
+	metrics->map_bytes          = map_bytes;
+	metrics->checkpoints        = 0;
+	metrics->checkpoint_seconds = 0;
+	metrics->render_seconds     = 0;
+	metrics->last_ns            = now_ns();
+	metrics->last_samples       = 0;
+
+	if(
+	        !(metrics->tmppath = malloc(strlen(conf->metrics) + strlen(METRICS_TMP_SUFFIX) + 1)) ||
+	        !(metrics->label = make_label(conf->statefile)) ||
+	        !stats_init(&(metrics->stats), conf->iters_n)) {
+		metrics_destroy(metrics);
+		return NULL;
+	}
+	strcat(strcpy(metrics->tmppath, conf->metrics), METRICS_TMP_SUFFIX);
+
+	return metrics;
+}
+
+void
+metrics_destroy(metrics_t* metrics) {
+	free(metrics->tmppath);
+	free(metrics->label);
+	stats_cleanup(&(metrics->stats));
+	free(metrics);
+}
+
+void
+metrics_update_rate(metrics_t* metrics) {
+	uint64_t now = now_ns();
+
+	if(now > metrics->last_ns) {
+		metrics->samples_rate = (metrics->stats.samples - metrics->last_samples) / ((now - metrics->last_ns) / 1e9);
+	}
+	metrics->last_ns      = now;
+	metrics->last_samples = metrics->stats.samples;
+}
+
+static void
+header(FILE* fh, const char* name, const char* type, const char* help) {
+	fprintf(fh, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* A sample of the metric name, extra is an additional label (or NULL). */
+static void
+sample_u64(FILE* fh, metrics_t* metrics, const char* name, const char* extra, uint64_t val) {
+	fprintf(fh, "%s{%s%s%s} %" PRIu64 "\n", name, metrics->label, extra ? "," : "", extra ? extra : "", val);
+}
+
+static void
+sample_double(FILE* fh, metrics_t* metrics, const char* name, const char* extra, double val) {
+	fprintf(fh, "%s{%s%s%s} %.9g\n", name, metrics->label, extra ? "," : "", extra ? extra : "", val);
+}
+
+int
+metrics_write(metrics_t* metrics) {
+	FILE*    fh;
+	int      l, rv;
+	char     labelbuf[LABELBUF_SIZE];
+	stats_t* stats = &(metrics->stats);
+
+	if(!(fh = fopen(metrics->tmppath, "w"))) {
+		return 0;
+	}
+
+	header(fh, "nebula2_jobs_done", "gauge", "Finished jobs, including the ones of previous runs.");
+	sample_u64(fh, metrics, "nebula2_jobs_done", NULL, metrics->jobs_done);
+	header(fh, "nebula2_jobs_todo", "gauge", "Jobs left in this run.");
+	sample_u64(fh, metrics, "nebula2_jobs_todo", NULL, metrics->jobs_todo);
+
+	header(fh, "nebula2_samples_total", "counter", "Samples drawn in this run.");
+	sample_u64(fh, metrics, "nebula2_samples_total", NULL, stats->samples);
+	header(fh, "nebula2_samples_per_second", "gauge", "Samples per second since the previous update.");
+	sample_double(fh, metrics, "nebula2_samples_per_second", NULL, metrics->samples_rate);
+	header(fh, "nebula2_rejected_samples_total", "counter", "Samples skipped by the cardioid/bulb test.");
+	sample_u64(fh, metrics, "nebula2_rejected_samples_total", NULL, stats->rejected);
+
+	header(fh, "nebula2_escaped_orbits_total", "counter", "Orbits scattered into a layer.");
+	for(l = 0; l < stats->layers; l++) {
+		snprintf(labelbuf, LABELBUF_SIZE, "layer=\"%d\"", l);
+		sample_u64(fh, metrics, "nebula2_escaped_orbits_total", labelbuf, stats->escaped[l]);
+	}
+	header(fh, "nebula2_deposited_points_total", "counter", "Points scattered into a layer.");
+	for(l = 0; l < stats->layers; l++) {
+		snprintf(labelbuf, LABELBUF_SIZE, "layer=\"%d\"", l);
+		sample_u64(fh, metrics, "nebula2_deposited_points_total", labelbuf, stats->deposited[l]);
+	}
+
+	header(fh, "nebula2_worker_seconds_total", "counter", "Time of all workers, by activity.");
+	sample_double(fh, metrics, "nebula2_worker_seconds_total", "state=\"iterate\"", stats->iterate_ns / 1e9);
+	sample_double(fh, metrics, "nebula2_worker_seconds_total", "state=\"scatter\"", stats->scatter_ns / 1e9);
+	sample_double(fh, metrics, "nebula2_worker_seconds_total", "state=\"idle\"", stats->idle_ns / 1e9);
+
+	header(fh, "nebula2_checkpoints_total", "counter", "Saved statefiles.");
+	sample_u64(fh, metrics, "nebula2_checkpoints_total", NULL, metrics->checkpoints);
+	header(fh, "nebula2_checkpoint_duration_seconds", "gauge", "Duration of the last statefile save.");
+	sample_double(fh, metrics, "nebula2_checkpoint_duration_seconds", NULL, metrics->checkpoint_seconds);
+	header(fh, "nebula2_render_duration_seconds", "gauge", "Duration of the render (0 until it is done).");
+	sample_double(fh, metrics, "nebula2_render_duration_seconds", NULL, metrics->render_seconds);
+
+	header(fh, "nebula2_map_bytes", "gauge", "Memory of the map, its replicas, shards and snapshots.");
+	sample_u64(fh, metrics, "nebula2_map_bytes", NULL, metrics->map_bytes);
+
+	rv = !ferror(fh);
+	if((fclose(fh) != 0) || !rv) {
+		remove(metrics->tmppath);
+		return 0;
+	}
+	return rename(metrics->tmppath, metrics->path) == 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _nebula2_metrics_h_
+#define _nebula2_metrics_h_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "stats.h"
+
+/*
+ * The metrics file (Prometheus text exposition format) for monitoring a run. It is written to a
+ * temporary file that replaces the metrics file, so a reader never sees a partial file. Every
+ * sample has the label statefile, so the files of several runs can be scraped together.
+ */
+typedef struct {
+	char* path;
+	char* tmppath;
+	char* label; /* statefile="...", escaped */
+
+	stats_t  stats;     /* Sum of the worker counters */
+	uint64_t jobs_done; /* Including the ones of previous runs */
+	uint64_t jobs_todo;
+	double   samples_rate; /* Samples/s since the previous update */
+	uint64_t map_bytes;    /* Memory of the map, its replicas, shards and snapshots */
+
+	uint64_t checkpoints;
+	double   checkpoint_seconds; /* Duration of the last checkpoint */
+	double   render_seconds;     /* Duration of the render (0 until it's done) */
+
+	uint64_t last_ns;
+	uint64_t last_samples;
+} metrics_t;
+
+extern metrics_t* metrics_create(config_t* conf, uint64_t map_bytes);
+extern void metrics_destroy(metrics_t* metrics);
+
+/* Set the rate of the samples, that are counted in metrics->stats now. */
+extern void metrics_update_rate(metrics_t* metrics);
+
+/* Replace the metrics file. */
+extern int metrics_write(metrics_t* metrics);
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "config.h"
+#include "orbit.h"
+#include "mh.h"
+
+#include "SFMT/SFMT.h"
+
+/* Probability of a large step (a new uniformly distributed c instead of a mutation of the current one). */
+#define MH_LARGE_STEP 0.1
+
+mh_t*
+mh_create(config_t* conf, orbit_ctx_t* orbit, int kernel, sfmt_t* sfmt_state) {
+	mh_t*  mh;
+	double conv;
+	int    hw, hh, i;
+
+	if(!(mh = malloc(sizeof(mh_t)))) {
+		return NULL;
+	}
+
+	precalc_nebula_params(conf, &conv, &(mh->mult_x), &(mh->mult_y), &hw, &hh);
+	mh->range_x = mh->mult_x * (UINT32_MAX / 2.0);
+	mh->range_y = mh->mult_y * (UINT32_MAX / 2.0);
+
+	/* Mutations move c by something between 1/64 of the rectangle and 1/1024 of a pixel. */
+	mh->s2        = ((mh->range_x < mh->range_y) ? mh->range_x : mh->range_y) / 32.0;
+	mh->log_s2_s1 = log(mh->s2 * conv * 1024.0);
+
+	mh->target_iter = (conf->mhlayer > 0) ? conf->iters[conf->mhlayer - 1] + 1 : 0;
+	mh->boost       = conf->mhboost;
+	mh->symmetric   = (conf->symmetry != SYMMETRY_OFF);
+	mh->steps       = 0;
+	mh->accepted    = 0;
+
+	/* The chains start at uniformly distributed points. */
+	for(i = 0; i < MH_CHAINS; i++) {
+		random_to_c(sfmt_genrand_uint64(sfmt_state), mh->mult_x, mh->mult_y, &(mh->cx[i]), &(mh->cy[i]));
+		if(mh->symmetric) {
+			mh->cx[i] = fabs(mh->cx[i]);
+		}
+		mh->repeats[i] = 0;
+	}
+	orbit_escape(orbit, kernel, mh->cx, mh->cy, MH_CHAINS, mh->escape);
+
+	return mh;
+}
+
+void
+mh_destroy(mh_t* mh) {
+	free(mh);
+}
+
+/* f(c), given the escape iteration of c */
+inline static uint32_t
+importance(mh_t* mh, int escape) {
+	return (escape >= mh->target_iter) ? mh->boost : 1;
+}
+
+/* Small step: move v by s2 * (s1/s2)^u into a random direction (Kelemen et al.). */
+inline static double
+mutate(mh_t* mh, double v, sfmt_t* sfmt_state) {
+	uint64_t r = sfmt_genrand_uint64(sfmt_state);
+	double   d = mh->s2 * exp(-(mh->log_s2_s1) * sfmt_to_res53(r));
+
+	return (r & 1) ? v + d : v - d;
+}
+
+/* Deposit the pending repeats of chain i. */
+static void
+deposit_chain(mh_t* mh, orbit_ctx_t* orbit, int i) {
+	if((mh->repeats[i] > 0) && (mh->escape[i] >= 0)) {
+		orbit_scatter(orbit, mh->cx[i], mh->cy[i], mh->escape[i], mh->repeats[i] * (mh->boost / importance(mh, mh->escape[i])));
+	}
+	mh->repeats[i] = 0;
+}
+
+void
+mh_step(mh_t* mh, orbit_ctx_t* orbit, int kernel, sfmt_t* sfmt_state, int n) {
+	int      i, j, np;
+	uint32_t f, fp;
+	double   pcx, pcy;
+
+	np = 0;
+	for(i = 0; i < n; i++) {
+		if(sfmt_genrand_res53(sfmt_state) < MH_LARGE_STEP) {
+			random_to_c(sfmt_genrand_uint64(sfmt_state), mh->mult_x, mh->mult_y, &pcx, &pcy);
+		} else {
+			pcx = mutate(mh, mh->cx[i], sfmt_state);
+			pcy = mutate(mh, mh->cy[i], sfmt_state);
+
+			/* f is 0 outside of the rectangle, so the proposal is rejected. */
+			if((fabs(pcx) > mh->range_x) || (fabs(pcy) > mh->range_y)) {
+				mh->repeats[i]++;
+				continue;
+			}
+		}
+
+		/* Reflecting the proposal keeps it symmetric, so the acceptance probability doesn't change. */
+		if(mh->symmetric) {
+			pcx = fabs(pcx);
+		}
+
+		mh->pcx[np]    = pcx;
+		mh->pcy[np]    = pcy;
+		mh->pchain[np] = i;
+		np++;
+	}
+
+	orbit_escape(orbit, kernel, mh->pcx, mh->pcy, np, mh->pescape);
+
+	for(j = 0; j < np; j++) {
+		i  = mh->pchain[j];
+		f  = importance(mh, mh->escape[i]);
+		fp = importance(mh, mh->pescape[j]);
+
+		/* Accept with probability min(1, fp / f) */
+		if((fp >= f) || (sfmt_genrand_res53(sfmt_state) * f < fp)) {
+			deposit_chain(mh, orbit, i);
+			mh->cx[i]      = mh->pcx[j];
+			mh->cy[i]      = mh->pcy[j];
+			mh->escape[i]  = mh->pescape[j];
+			mh->repeats[i] = 1;
+			mh->accepted++;
+		} else {
+			mh->repeats[i]++;
+		}
+	}
+
+	mh->steps += n;
+}
+
+void
+mh_flush(mh_t* mh, orbit_ctx_t* orbit) {
+	int i;
+
+	for(i = 0; i < MH_CHAINS; i++) {
+		deposit_chain(mh, orbit, i);
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef _nebula2_mh_h_
+#define _nebula2_mh_h_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "orbit.h"
+
+#include "SFMT/SFMT.h"
+
+/* Number of Markov chains per worker. They are advanced together, so the SIMD kernel can be used. */
+#define MH_CHAINS 64
+
+/*
+ * Metropolis-Hastings sampler for c. The chains sample c with a density proportional to f(c),
+ * which is boost for orbits escaping in a target layer (>= mhlayer) and 1 for all other c.
+ * Deposits are weighted with boost / f(c), so the histogram stays unbiased (up to a global
+ * factor, which doesn't change the rendered image).
+ */
+typedef struct {
+	/* Current states. repeats counts the steps the state was not yet deposited for. */
+	double   cx[MH_CHAINS], cy[MH_CHAINS];
+	int      escape[MH_CHAINS];
+	uint32_t repeats[MH_CHAINS];
+
+	/* Proposals (only the ones inside the sampled rectangle, pchain is the chain they belong to) */
+	double pcx[MH_CHAINS], pcy[MH_CHAINS];
+	int    pescape[MH_CHAINS];
+	int    pchain[MH_CHAINS];
+
+	int      target_iter; /* Orbits escaping at this iteration or later are in a target layer. */
+	uint32_t boost;
+	int      symmetric; /* Only sample c with cx >= 0 */
+
+	/* Sampled rectangle and mutation sizes (see mutate() in mh.c) */
+	double mult_x, mult_y;
+	double range_x, range_y;
+	double s2, log_s2_s1;
+
+	/* Statistics */
+	uint64_t steps;
+	uint64_t accepted;
+} mh_t;
+
+extern mh_t* mh_create(config_t* conf, orbit_ctx_t* orbit, int kernel, sfmt_t* sfmt_state);
+extern void mh_destroy(mh_t* mh);
+
+/* Advance the first n chains by one step. */
+extern void mh_step(mh_t* mh, orbit_ctx_t* orbit, int kernel, sfmt_t* sfmt_state, int n);
+
+/* Deposit the pending repeats of all chains (at the end of a job). */
+extern void mh_flush(mh_t* mh, orbit_ctx_t* orbit);
+
+#endif
@@ -3,79 +3,160 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
 
 #include <pthread.h>
 
 #include "config.h"
 #include "statefile.h"
 #include "render.h"
-#include "mutex_helpers.h"
+#include "orbit.h"
+#include "mh.h"
+#include "mask.h"
+#include "numa.h"
+#include "rng.h"
+#include "convergence.h"
+#include "stats.h"
+#include "metrics.h"
+#include "regress.h"
+#include "merge.h"
 
 #include "SFMT/SFMT.h"
 
-/* Bailout is currently hard coded... perhaps we should move this to the config file? */
-#define BAILOUT 8
+/* Number of samples that are generated at once and handed to the orbit kernel. */
+#define SAMPLE_BLOCK 4096
 
-inline static long
-fast_floor(double input) {
-	return (long) input - (input > 0 ? 0 : 1);
-}
+/* Random numbers SFMT generates at once (must be even and at least sfmt_get_min_array_size64()). */
+#define RNG_BUFFER (2 * SAMPLE_BLOCK)
 
-inline static void
-calc_mandelbrot(double cx, double cy, double* zx, double* zy) {
-	double ty;
-	ty  = (*zy) * (*zy) - (*zx) * (*zx) + cy;
-	*zx = 2.0 * (*zy) * (*zx) + cx;
-	*zy = ty;
-}
+/* Size of the first job with adaptive job sizing (see jobtime) */
+#define MIN_JOB 64
 
-void
-precalc_nebula_params(config_t* conf, double* conv, double* mult_x, double* mult_y, int* hw, int* hh) {
-	*conv = ((conf->width < conf->height) ? conf->width : conf->height) / 4.0;
+/* How often the main thread checks for signals and finished workers (in ms). */
+#define SUPERVISE_INTERVAL 100
 
-	*mult_x = (double) (0.8 * conf->width  / *conv) / (UINT32_MAX / 2.0);
-	*mult_y = (double) (0.8 * conf->height / *conv) / (UINT32_MAX / 2.0);
+/* With symmetry, only c with cx >= 0 are sampled (cx is the imaginary part). */
+static void
+fold_samples(config_t* conf, double* cx, int n) {
+	int i;
 
-	*hw = conf->width / 2;
-	*hh = conf->height / 2;
+	if(conf->symmetry == SYMMETRY_OFF) {
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		cx[i] = fabs(cx[i]);
+	}
 }
 
 void
 usage(void) {
 	fputs("nebula2 needs the name of a config file as 1st argument.\n", stderr);
+	fputs("nebula2 merge <output statefile> <statefile>... adds up statefiles.\n", stderr);
 }
 
-/* Data that is shared between all processes. */
+/* A checkpoint that is written by a background thread */
+typedef struct {
+	config_t*  conf;
+	uint32_t** maps;  /* Replicas to add to the map before it is saved */
+	uint64_t   samples; /* Finished samples in the map and maps */
+	uint64_t   start; /* now_ns() at the start and the end of the checkpoint */
+	uint64_t   end;
+	pthread_t  thread;
+	int        running;  /* Started and not finished yet */
+	int        threaded; /* Written by thread, which has to be joined */
+	int        done;     /* Set by the thread when it's done */
+	int        ok;
+	int        errsv;
+} checkpoint_t;
+
+/*
+ * Data that is shared between all processes. Workers claim their jobs by incrementing
+ * samples_claimed, the counters are only accessed atomically. The work is accounted in samples,
+ * since jobs don't need to be jobsize samples (see jobtime).
+ */
 typedef struct {
 	uint32_t* map;
-	uint32_t  jobs_todo;
-
-	pthread_mutex_t* jobrq_get_mu;
-	pthread_mutex_t* jobrq_set_mu;
-	int              jobrq;
+	mask_t*   mask;
+
+	/* With numa=1, the workers of every node scatter into a replica of the map on that node. */
+	topology_t* topo;
+	uint32_t**  replicas;
+	int         replicas_n;
+	uint8_t*    dirty; /* With mmap=1, the chunks of the map the replicas changed since the last sync */
+
+	/*
+	 * With checkpoint > 0, the workers always scatter into replicas (one, unless numa=1), so the
+	 * map only holds complete checkpoints. A checkpoint pauses the workers at the next jobsize
+	 * boundary, swaps the replicas with the zeroed spares and adds the old replicas to the map and
+	 * saves it in the background, while the workers continue.
+	 */
+	uint32_t**      spares;
+	int             pause;  /* Set to make the workers wait at the next jobsize boundary */
+	int             paused; /* Waiting workers */
+	pthread_mutex_t pause_lock;
+	pthread_cond_t  pause_cond;
+	checkpoint_t    ckpt;
+
+	uint64_t samples_base;    /* Index of the first sample of this run (for rng=philox) */
+	uint64_t samples_todo;    /* Samples to calculate in this run */
+	uint64_t samples_claimed;
+	uint64_t samples_done;    /* Samples finished in this run */
+	uint64_t samples_merged;  /* Finished samples whose points are in the map (or the replicas) */
+	int      stop;            /* Set to make the workers stop after their current job */
+	int      workers_running;
 } nebula_data_t;
 
-/* Set the jobrq variable (e.g. request a new job) */
-void
-jobrq_set(nebula_data_t* nd, int val) {
-	pthread_mutex_lock(nd->jobrq_set_mu);
-	nd->jobrq = val;
-	pthread_mutex_unlock(nd->jobrq_get_mu);
+/* Do the samples only depend on their index (and the seed)? */
+static int
+indexed_samples(config_t* conf) {
+	return (conf->rng == RNG_PHILOX) || (conf->sampler == SAMPLER_SOBOL);
 }
 
-/* Get the next jobrq value */
-int
-jobrq_get(nebula_data_t* nd) {
-	int rv;
+/*
+ * Claim a job of up to want samples, starting at sample *first. Returns the claimed number of
+ * samples, 0 if everything is claimed or the calculation was stopped (or paused).
+ *
+ * With indexed samples, a job never crosses a multiple of jobsize and a stopped calculation still
+ * finishes the started jobsize unit. Checkpoints pause the workers the same way, so the replicas
+ * hold exactly the finished samples. (The statefile counts samples, so a stopped run doesn't lose
+ * any either way.)
+ */
+static uint64_t
+claim_samples(config_t* conf, nebula_data_t* nd, uint64_t want, uint64_t* first) {
+	uint64_t start, n;
+	int      stop;
+
+	if(!indexed_samples(conf) && !conf->checkpoint) {
+		if(__atomic_load_n(&(nd->stop), __ATOMIC_RELAXED)) {
+			return 0;
+		}
 
-	pthread_mutex_lock(nd->jobrq_get_mu);
-	rv = nd->jobrq;
-	pthread_mutex_unlock(nd->jobrq_set_mu);
-	return rv;
+		*first = __atomic_fetch_add(&(nd->samples_claimed), want, __ATOMIC_RELAXED);
+		if(*first >= nd->samples_todo) {
+			return 0;
+		}
+		return (want < nd->samples_todo - *first) ? want : nd->samples_todo - *first;
+	}
+
+	start = __atomic_load_n(&(nd->samples_claimed), __ATOMIC_RELAXED);
+	do {
+		stop = __atomic_load_n(&(nd->stop), __ATOMIC_RELAXED) || __atomic_load_n(&(nd->pause), __ATOMIC_RELAXED);
+		if((start >= nd->samples_todo) || (stop && (start % conf->jobsize == 0))) {
+			return 0;
+		}
+		n = conf->jobsize - start % conf->jobsize;
+		n = (want < n) ? want : n;
+		n = (nd->samples_todo - start < n) ? nd->samples_todo - start : n;
+	} while(!__atomic_compare_exchange_n(&(nd->samples_claimed), &start, start + n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*first = start;
+	return n;
 }
 
 nebula_data_t*
-nebula_data_create(config_t* conf) {
+nebula_data_create(config_t* conf, uint64_t* samples) {
 	size_t         mapsize;
 	nebula_data_t* nd = NULL;
 
@@ -83,67 +164,120 @@ nebula_data_create(config_t* conf) {
 		return NULL;
 	}
 
-	mapsize = conf->width * conf->height * conf->iters_n;
-
-	nd->map          = NULL;
-	nd->jobrq_set_mu = NULL;
-	nd->jobrq_get_mu = NULL;
-
-	if(!(nd->jobrq_get_mu = mutex_create())) {
-		fputs("Could not init jobrq_get_mu mutex.\n", stderr);
-		goto failed;
-	}
-	if(!(nd->jobrq_set_mu = mutex_create())) {
-		fputs("Could not init jobrq_set_mu mutex.\n", stderr);
-		goto failed;
-	}
-	/* The set mutex needs to be initially unlocked, so one worker can start requesting jobs. */
-	pthread_mutex_unlock(nd->jobrq_set_mu);
-
-	if(!(nd->map = malloc(sizeof(uint32_t) * mapsize))) {
-		fputs("Could not allocate memory for map.\n", stderr);
-		goto failed;
+	mapsize = (size_t) conf_map_width(conf) * conf->height * conf->iters_n;
+
+	nd->mask            = NULL;
+	nd->topo            = NULL;
+	nd->replicas        = NULL;
+	nd->replicas_n      = 0;
+	nd->dirty           = NULL;
+	nd->spares          = NULL;
+	nd->pause           = 0;
+	nd->paused          = 0;
+	nd->ckpt.running    = 0;
+	nd->samples_base    = 0;
+	nd->samples_todo    = 0;
+	nd->samples_claimed = 0;
+	nd->samples_done    = 0;
+	nd->samples_merged  = 0;
+	nd->stop            = 0;
+	nd->workers_running = 0;
+
+	if(conf->mmap) {
+		if(!(nd->map = state_map(conf, 1, samples))) {
+			fprintf(stderr, "Error while mapping statefile: %s\n", strerror(errno));
+			free(nd);
+			return NULL;
+		}
+	} else {
+		if(!(nd->map = malloc(sizeof(uint32_t) * mapsize))) {
+			fputs("Could not allocate memory for map.\n", stderr);
+			free(nd);
+			return NULL;
+		}
+		if(!state_load(conf, nd->map, samples)) {
+			fprintf(stderr, "Error while loading state: %s\n", strerror(errno));
+			free(nd->map);
+			free(nd);
+			return NULL;
+		}
 	}
+	pthread_mutex_init(&(nd->pause_lock), NULL);
+	pthread_cond_init(&(nd->pause_cond), NULL);
 
 	return nd;
+}
 
-failed:
-	if(nd->jobrq_set_mu) {
-		mutex_destroy(nd->jobrq_set_mu);
+void
+nebula_data_destroy(config_t* conf, nebula_data_t* nd) {
+	int i;
+
+	if(nd->ckpt.running && nd->ckpt.threaded) {
+		pthread_join(nd->ckpt.thread, NULL);
 	}
-	if(nd->jobrq_get_mu) {
-		mutex_destroy(nd->jobrq_get_mu);
+	if(nd->replicas) {
+		for(i = 0; i < nd->replicas_n; i++) {
+			free(nd->replicas[i]);
+		}
+		free(nd->replicas);
 	}
-	if(nd->map) {
-		free(nd->map);
+	if(nd->spares) {
+		for(i = 0; i < nd->replicas_n; i++) {
+			free(nd->spares[i]);
+		}
+		free(nd->spares);
+	}
+	free(nd->dirty);
+	if(nd->topo) {
+		topology_destroy(nd->topo);
 	}
-	return NULL;
-}
-
-void
-nebula_data_destroy(nebula_data_t* nd) {
 	if(nd->map) {
-		free(nd->map);
+		if(conf->mmap) {
+			state_unmap(conf, nd->map);
+		} else {
+			free(nd->map);
+		}
+	}
+	if(nd->mask) {
+		mask_destroy(nd->mask);
 	}
-	mutex_destroy(nd->jobrq_set_mu);
-	mutex_destroy(nd->jobrq_get_mu);
+	pthread_mutex_destroy(&(nd->pause_lock));
+	pthread_cond_destroy(&(nd->pause_cond));
 	free(nd);
 }
 
-typedef struct {
-	int x, y;
-} pos_t;
-
 /* Data of a single worker */
 typedef struct {
-	int              id;
-	pthread_mutex_t* mu;
-	int              ok;
+	int id;
 
-	pos_t* pointlist;
+	orbit_ctx_t orbit;
+	mh_t*       mh;
+
+	/* The map of the worker's node (nd->map, unless numa=1 or checkpoint > 0) */
+	uint32_t* target;
+	int       node;
+
+	/* Private histogram (with shards=1), merged into the target map every shardmerge * jobsize samples. */
+	uint32_t* shard;
+	uint64_t  shard_samples;
 
 	sfmt_t* sfmt_state;
 
+	/* Buffers for a block of samples: random bits (rng_buf for SFMT, lo and hi for Philox) and c */
+	uint64_t* rng_buf;
+	int       rng_pos;
+	uint64_t* lo;
+	uint64_t* hi;
+	double*   cx;
+	double*   cy;
+
+	/* Private counters (the orbit kernel counts in orbit) and the published ones */
+	uint64_t samples;
+	uint64_t start_ns;
+	uint64_t busy_ns;  /* Time in run_job() */
+	uint64_t merge_ns; /* Time in merge_shard() */
+	stats_t  stats;
+
 	config_t*      conf;
 	nebula_data_t* nd;
 
@@ -151,86 +285,270 @@ typedef struct {
 	int       thread_started;
 } worker_data_t;
 
-inline static pos_t
-calc_pos(double zx, double zy, size_t width, size_t height, double conv, int hw, int hh) {
-	pos_t rv;
-	rv.x = fast_floor(zx * conv) + hw;
-	rv.y = fast_floor(zy * conv) + hh;
+/*
+ * Add a shard to the shared map and clear it. Other workers may merge at the same time, so the
+ * additions are atomic. Zeros are skipped, most pixels of deep layers are never hit during a job.
+ */
+static void
+merge_shard(worker_data_t* wd) {
+	size_t    i;
+	size_t    n     = (size_t) conf_map_width(wd->conf) * wd->conf->height * wd->conf->iters_n;
+	uint32_t* map   = wd->target;
+	uint32_t* shard = wd->shard;
+
+	for(i = 0; i < n; i++) {
+		if(shard[i]) {
+			__atomic_fetch_add(map + i, shard[i], __ATOMIC_RELAXED);
+			shard[i] = 0;
+		}
+	}
+	__atomic_fetch_add(&(wd->nd->samples_merged), wd->shard_samples, __ATOMIC_RELAXED);
+	wd->shard_samples = 0;
+}
 
-	if((rv.x < 0) || (rv.y < 0) || (rv.x >= width) || (rv.y >= height)) {
-		rv.x = -1;
+/*
+ * Random bits of the n (<= SAMPLE_BLOCK) samples starting at sample first of this run. hi is only
+ * needed for the mask. SFMT fills a whole buffer at once, lo and hi then point into this buffer.
+ */
+static void
+random_bits(worker_data_t* wd, uint64_t first, int n, uint64_t** lo, uint64_t** hi) {
+	int need = wd->nd->mask ? 2 * n : n;
+
+	/* The points of the Sobol sampler are used like random bits (the mask can't be used with it). */
+	if(wd->conf->sampler == SAMPLER_SOBOL) {
+		sobol_fill(wd->conf->seed, wd->nd->samples_base + first, n, wd->lo);
+		*lo = wd->lo;
+		*hi = wd->hi;
+		return;
 	}
 
-	return rv;
+	if(wd->conf->rng == RNG_PHILOX) {
+		philox_fill(wd->conf->seed, wd->nd->samples_base + first, n, wd->lo, wd->hi);
+		*lo = wd->lo;
+		*hi = wd->hi;
+		return;
+	}
+
+	/* The rest of the buffer is discarded, if it's too short. */
+	if(wd->rng_pos + need > RNG_BUFFER) {
+		sfmt_fill_array64(wd->sfmt_state, wd->rng_buf, RNG_BUFFER);
+		wd->rng_pos = 0;
+	}
+	*lo          = wd->rng_buf + wd->rng_pos;
+	*hi          = *lo + n;
+	wd->rng_pos += need;
 }
 
-/* The background worker */
-void*
-worker(void* _wd) {
+/* Calculate a job of the given number of samples, starting at sample first. */
+static void
+run_job(worker_data_t* wd, uint64_t first, uint64_t samples) {
 	/* Precalculated data (scaling factors etc.) */
 	double conv, mult_x, mult_y;
 	int    hw, hh;
 
 	/* Mandelbrot point vars */
-	uint64_t xy;
-	double   cx, cy, zx, zy;
+	uint64_t* lo;
+	uint64_t* hi;
+	double    x, y;
 
 	/* Misc... */
-	int    todo;
-	int    iter, maxiter, mii;
-	size_t off, mapsize;
-	pos_t  pos;
+	uint64_t todo;
+	int      n, i, nfast;
 
 	/* Aliases */
-	worker_data_t* wd         = _wd;
-	nebula_data_t* nd         = wd->nd;
-	config_t*      conf       = wd->conf;
-	sfmt_t*        sfmt_state = wd->sfmt_state;
-	pos_t*         pointlist;
-	uint32_t*      map    = nd->map;
-	size_t         width  = conf->width;
-	size_t         height = conf->height;
+	nebula_data_t* nd   = wd->nd;
+	config_t*      conf = wd->conf;
+	double*        cx   = wd->cx;
+	double*        cy   = wd->cy;
+
+	if(wd->mh) {
+		for(todo = samples; todo > 0; todo -= n) {
+			n = (todo < MH_CHAINS) ? todo : MH_CHAINS;
+			mh_step(wd->mh, &(wd->orbit), conf->kernel, wd->sfmt_state, n);
+		}
+		mh_flush(wd->mh, &(wd->orbit));
+		return;
+	}
+
+	if(nd->mask) {
+		for(todo = samples; todo > 0; todo -= n, first += n) {
+			n = (todo < SAMPLE_BLOCK) ? todo : SAMPLE_BLOCK;
+			random_bits(wd, first, n, &lo, &hi);
+
+			/* Samples from interesting cells go to the front, the ones from fast cells to the back. */
+			i     = 0;
+			nfast = 0;
+			while(i + nfast < n) {
+				if(mask_sample(nd->mask, lo[i + nfast], hi[i + nfast], &x, &y) == 1) {
+					cx[i] = x;
+					cy[i] = y;
+					i++;
+				} else {
+					nfast++;
+					cx[n - nfast] = x;
+					cy[n - nfast] = y;
+				}
+			}
+
+			fold_samples(conf, cx, n);
+			orbit_trace(&(wd->orbit), conf->kernel, cx, cy, i, 1);
+			orbit_trace(&(wd->orbit), conf->kernel, cx + i, cy + i, nfast, nd->mask->weight);
+		}
+		return;
+	}
 
 	precalc_nebula_params(conf, &conv, &mult_x, &mult_y, &hw, &hh);
-	mapsize = width * height;
-	maxiter = conf->iters[conf->iters_n - 1];
+
+	for(todo = samples; todo > 0; todo -= n, first += n) {
+		n = (todo < SAMPLE_BLOCK) ? todo : SAMPLE_BLOCK;
+		random_bits(wd, first, n, &lo, &hi);
+		for(i = 0; i < n; i++) {
+			random_to_c(lo[i], mult_x, mult_y, &(cx[i]), &(cy[i]));
+		}
+		fold_samples(conf, cx, n);
+
+		orbit_trace(&(wd->orbit), conf->kernel, cx, cy, n, 1);
+	}
+}
+
+static double
+elapsed_ms(struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Size of the next job, so it takes about jobtime ms. A single job might be unrepresentative (e.g.
+ * most of its samples were rejected), so the size changes at most by a factor of 2 per job.
+ */
+static uint64_t
+next_job_size(config_t* conf, uint64_t samples, double ms) {
+	uint64_t next;
+
+	if(ms * 2 <= conf->jobtime) {
+		next = samples * 2;
+	} else if(ms >= conf->jobtime * 2) {
+		next = samples / 2;
+	} else {
+		next = samples * (conf->jobtime / ms);
+	}
+
+	return (next < MIN_JOB) ? MIN_JOB : next;
+}
+
+/* Publish the counters of the worker (once per job, so the workers don't compete for cache lines). */
+static void
+publish_stats(worker_data_t* wd) {
+	stats_t local;
+
+	local.layers     = wd->stats.layers;
+	local.samples    = wd->samples;
+	local.rejected   = wd->orbit.rejected;
+	local.escaped    = wd->orbit.escaped;
+	local.deposited  = wd->orbit.deposited;
+	local.iterate_ns = wd->busy_ns - wd->orbit.scatter_ns;
+	local.scatter_ns = wd->orbit.scatter_ns + wd->merge_ns;
+	local.idle_ns    = now_ns() - wd->start_ns - wd->busy_ns - wd->merge_ns;
+
+	stats_store(&(wd->stats), &local);
+}
+
+/* Merge the shard of the worker and account the time. */
+static void
+timed_merge_shard(worker_data_t* wd) {
+	uint64_t start = now_ns();
+
+	merge_shard(wd);
+	wd->merge_ns += now_ns() - start;
+}
+
+/*
+ * Wait while a checkpoint pauses the workers, after merging the shard into the replica that is
+ * saved. Afterwards the worker scatters into the new replica. Returns 0, if the worker is done.
+ */
+static int
+wait_for_checkpoint(worker_data_t* wd) {
+	nebula_data_t* nd = wd->nd;
+
+	if(__atomic_load_n(&(nd->pause), __ATOMIC_ACQUIRE)) {
+		if(wd->shard) {
+			timed_merge_shard(wd);
+		}
+
+		pthread_mutex_lock(&(nd->pause_lock));
+		nd->paused++;
+		pthread_cond_broadcast(&(nd->pause_cond));
+		while(nd->pause) {
+			pthread_cond_wait(&(nd->pause_cond), &(nd->pause_lock));
+		}
+		nd->paused--;
+		pthread_mutex_unlock(&(nd->pause_lock));
+
+		wd->target = nd->replicas[wd->node];
+		if(!wd->shard) {
+			wd->orbit.map = wd->target;
+		}
+	}
+
+	return !__atomic_load_n(&(nd->stop), __ATOMIC_RELAXED) &&
+	       (__atomic_load_n(&(nd->samples_claimed), __ATOMIC_RELAXED) < nd->samples_todo);
+}
+
+/* The background worker */
+void*
+worker(void* _wd) {
+	uint64_t samples, want, first, start, ns;
+
+	/* Aliases */
+	worker_data_t* wd   = _wd;
+	nebula_data_t* nd   = wd->nd;
+	config_t*      conf = wd->conf;
+
+	want         = conf->jobtime ? MIN_JOB : conf->jobsize;
+	wd->start_ns = now_ns();
 
 	for(;; ) {
-		jobrq_set(nd, wd->id);
-		pthread_mutex_lock(wd->mu);
-		if(!wd->ok) {
-			return NULL;
+		if(wd->shard && (wd->shard_samples >= (uint64_t) conf->shardmerge * conf->jobsize)) {
+			timed_merge_shard(wd);
 		}
 
-		for(todo = conf->jobsize; todo--; ) {
-			xy = sfmt_genrand_uint64(sfmt_state);
-			cx = ((int32_t) (xy >> 32)) * mult_x;
-			cy = ((int32_t) (xy & UINT32_MAX)) * mult_y;
-			zx = zy = .0;
-
-			pointlist = wd->pointlist;
-			for(iter = 0; iter < maxiter; iter++) {
-				calc_mandelbrot(cx, cy, &zx, &zy);
-				*(pointlist++) = calc_pos(zx, zy, width, height, conv, hw, hh);
-				if((zx * zx) + (zy * zy) > BAILOUT) {
-					for(mii = 0; iter > conf->iters[mii]; mii++) {}
-					off = mii * mapsize;
-					do {
-						/*
-						 * To be 100% accurate, we would need to synchronize the access to the map here.
-						 * We ignore this, since collision should be seldom.
-						 */
-						pos = *(--pointlist);
-						if(pos.x < 0) {
-							continue;
-						}
-						map[off + width * pos.y + pos.x]++;
-					} while(iter-- > 0);
-					break;
-				}
+		if(!(samples = claim_samples(conf, nd, want, &first))) {
+			if(conf->checkpoint && wait_for_checkpoint(wd)) {
+				continue;
 			}
+			break;
 		}
+
+		start = now_ns();
+		run_job(wd, first, samples);
+		ns           = now_ns() - start;
+		wd->busy_ns += ns;
+		if(conf->jobtime) {
+			want = next_job_size(conf, samples, ns / 1000000.0);
+		}
+
+		wd->samples       += samples;
+		wd->shard_samples += samples;
+		__atomic_fetch_add(&(nd->samples_done), samples, __ATOMIC_RELAXED);
+		if(!wd->shard) {
+			__atomic_fetch_add(&(nd->samples_merged), samples, __ATOMIC_RELAXED);
+		}
+		publish_stats(wd);
 	}
+
+	if(wd->shard) {
+		timed_merge_shard(wd);
+	}
+	publish_stats(wd);
+
+	/* A checkpoint may wait for the running workers. */
+	pthread_mutex_lock(&(nd->pause_lock));
+	__atomic_fetch_sub(&(nd->workers_running), 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&(nd->pause_cond));
+	pthread_mutex_unlock(&(nd->pause_lock));
+	return NULL;
 }
 
 sfmt_t*
@@ -269,29 +587,85 @@ failed:
 /* Init and run a worker */
 int
 worker_init(worker_data_t* wd, int id, config_t* conf, nebula_data_t* nd) {
+	pthread_attr_t attr;
+	int            started;
+
 	wd->id             = id;
-	wd->ok             = 1;
 	wd->conf           = conf;
 	wd->nd             = nd;
 	wd->thread_started = 0;
 
-	wd->mu         = NULL;
-	wd->pointlist  = NULL;
-	wd->sfmt_state = NULL;
+	wd->orbit.pointlist = NULL;
+	wd->orbit.escaped   = NULL;
+	wd->stats.escaped   = NULL;
+	wd->mh              = NULL;
+	wd->shard           = NULL;
+	wd->shard_samples   = 0;
+	wd->sfmt_state      = NULL;
+	wd->rng_buf         = NULL;
+	wd->rng_pos         = RNG_BUFFER;
+	wd->lo              = NULL;
+	wd->hi              = NULL;
+	wd->cx              = NULL;
+	wd->cy              = NULL;
+	wd->samples         = 0;
+	wd->start_ns        = 0;
+	wd->busy_ns         = 0;
+	wd->merge_ns        = 0;
+
+	if(!stats_init(&(wd->stats), conf->iters_n)) {
+		goto failed;
+	}
 
 	if(!(wd->sfmt_state = init_sfmt())) {
 		goto failed;
 	}
 
-	if(!(wd->mu = mutex_create())) {
+	/* sfmt_fill_array64 needs 16 byte aligned memory. */
+	if(posix_memalign((void**) &(wd->rng_buf), 16, sizeof(uint64_t) * RNG_BUFFER) != 0) {
+		wd->rng_buf = NULL;
+		goto failed;
+	}
+	if(
+	        !(wd->lo = malloc(sizeof(uint64_t) * SAMPLE_BLOCK)) ||
+	        !(wd->hi = malloc(sizeof(uint64_t) * SAMPLE_BLOCK)) ||
+	        !(wd->cx = malloc(sizeof(double) * SAMPLE_BLOCK)) ||
+	        !(wd->cy = malloc(sizeof(double) * SAMPLE_BLOCK))) {
 		goto failed;
 	}
 
-	if(!(wd->pointlist = malloc(sizeof(pos_t) * conf->iters[conf->iters_n - 1]))) {
+	if(conf->shards) {
+		if(!(wd->shard = calloc((size_t) conf_map_width(conf) * conf->height * conf->iters_n, sizeof(uint32_t)))) {
+			goto failed;
+		}
+	}
+
+	wd->node   = conf->numa ? topology_node(nd->topo, id) : 0;
+	wd->target = nd->replicas ? nd->replicas[wd->node] : nd->map;
+	if(!orbit_ctx_init(&(wd->orbit), conf, wd->shard ? wd->shard : wd->target)) {
+		goto failed;
+	}
+
+	if(conf->sampler == SAMPLER_MH) {
+		if(!(wd->mh = mh_create(conf, &(wd->orbit), conf->kernel, wd->sfmt_state))) {
+			goto failed;
+		}
+	}
+
+	/* With numa=1, workers are pinned to their CPU, so their memory stays on their node. */
+	if(pthread_attr_init(&attr) != 0) {
+		goto failed;
+	}
+	if(conf->numa && !topology_pin(nd->topo, id, &attr)) {
+		pthread_attr_destroy(&attr);
 		goto failed;
 	}
 
-	if(pthread_create(&(wd->thread), NULL, worker, wd) != 0) {
+	__atomic_fetch_add(&(nd->workers_running), 1, __ATOMIC_RELAXED);
+	started = (pthread_create(&(wd->thread), &attr, worker, wd) == 0);
+	pthread_attr_destroy(&attr);
+	if(!started) {
+		__atomic_fetch_sub(&(nd->workers_running), 1, __ATOMIC_RELAXED);
 		goto failed;
 	}
 
@@ -299,15 +673,22 @@ worker_init(worker_data_t* wd, int id, config_t* conf, nebula_data_t* nd) {
 	return 1;
 
 failed:
-	if(wd->mu) {
-		mutex_destroy(wd->mu);
+	orbit_ctx_cleanup(&(wd->orbit));
+	stats_cleanup(&(wd->stats));
+	if(wd->mh) {
+		mh_destroy(wd->mh);
 	}
-	if(wd->pointlist) {
-		free(wd->pointlist);
+	if(wd->shard) {
+		free(wd->shard);
 	}
 	if(wd->sfmt_state) {
 		free(wd->sfmt_state);
 	}
+	free(wd->rng_buf);
+	free(wd->lo);
+	free(wd->hi);
+	free(wd->cx);
+	free(wd->cy);
 	return 0;
 }
 
@@ -316,26 +697,36 @@ worker_cleanup(worker_data_t* wd) {
 	if(wd->thread_started) {
 		pthread_join(wd->thread, NULL);
 	}
-	if(wd->pointlist) {
-		free(wd->pointlist);
+	orbit_ctx_cleanup(&(wd->orbit));
+	stats_cleanup(&(wd->stats));
+	if(wd->mh) {
+		mh_destroy(wd->mh);
+	}
+	if(wd->shard) {
+		free(wd->shard);
 	}
 	if(wd->sfmt_state) {
 		free(wd->sfmt_state);
 	}
-	mutex_destroy(wd->mu);
+	free(wd->rng_buf);
+	free(wd->lo);
+	free(wd->hi);
+	free(wd->cx);
+	free(wd->cy);
 }
 
-/* Global reference to shared data (needed by sighandler) */
-nebula_data_t* global_nd;
+/* Set by the signal handler, handled by the main thread. */
+static volatile sig_atomic_t stop_requested     = 0;
+static volatile sig_atomic_t progress_requested = 0;
 
 void
 sighandler(int sig) {
 	switch(sig) {
 	case SIGINT:
-		jobrq_set(global_nd, -1);
+		stop_requested = 1;
 		break;
 	case SIGUSR1:
-		printf("Jobs todo: %d\n", global_nd->jobs_todo);
+		progress_requested = 1;
 		break;
 	}
 }
@@ -356,41 +747,427 @@ setup_sighandler(void) {
 	return 1;
 }
 
+/* Sum up the published counters of all workers. */
+static void
+collect_stats(config_t* conf, worker_data_t* workers, stats_t* sum) {
+	int i;
+
+	stats_clear(sum);
+	for(i = 0; i < conf->threads; i++) {
+		stats_add(sum, &(workers[i].stats));
+	}
+}
+
+/*
+ * Print the jobs left, the rates since the last report (stats[1], which is updated) and the
+ * estimated time left (based on the average rate since start).
+ */
+static void
+report_progress(config_t* conf, nebula_data_t* nd, worker_data_t* workers, stats_t* stats, uint64_t start, uint64_t* last) {
+	uint64_t done, left, eta;
+	uint64_t now = now_ns();
+
+	done = __atomic_load_n(&(nd->samples_done), __ATOMIC_RELAXED);
+	left = nd->samples_todo - done;
+	printf("Jobs todo: %" PRIu64 "\n", (left + conf->jobsize - 1) / conf->jobsize);
+
+	collect_stats(conf, workers, stats);
+	stats_print(stats, stats + 1, (now - *last) / 1e9);
+	stats_copy(stats + 1, stats);
+	*last = now;
+
+	if(done > 0) {
+		eta = (uint64_t) ((double) left / done * ((now - start) / 1e9));
+		printf("ETA: %" PRIu64 ":%02d:%02d\n", eta / 3600, (int) (eta / 60 % 60), (int) (eta % 60));
+	}
+}
+
+/* Update the metrics file with the current counters. */
+static void
+update_metrics(config_t* conf, nebula_data_t* nd, worker_data_t* workers, metrics_t* metrics) {
+	uint64_t done = __atomic_load_n(&(nd->samples_done), __ATOMIC_RELAXED);
+
+	collect_stats(conf, workers, &(metrics->stats));
+	metrics_update_rate(metrics);
+	metrics->jobs_done = (nd->samples_base + done) / conf->jobsize;
+	metrics->jobs_todo = (nd->samples_todo - done + conf->jobsize - 1) / conf->jobsize;
+
+	if(!metrics_write(metrics)) {
+		fprintf(stderr, "Could not write metrics file: %s\n", strerror(errno));
+	}
+}
+
+/* Memory of the map and all its copies */
+static uint64_t
+map_bytes(config_t* conf, nebula_data_t* nd, conv_t* conv) {
+	uint64_t copies = 1;
+
+	if(nd->replicas) {
+		copies += nd->replicas_n;
+	}
+	if(nd->spares) {
+		copies += nd->replicas_n;
+	}
+	if(conf->shards) {
+		copies += conf->threads;
+	}
+	if(conv) {
+		copies += 2;
+	}
+	return copies * sizeof(uint32_t) * conf_map_width(conf) * conf->height * conf->iters_n;
+}
+
+/*
+ * Save the map (which with mmap=1 only needs to be synced). Without replicas, the workers may
+ * have changed any chunk of the map.
+ */
+static int
+save_state(config_t* conf, nebula_data_t* nd, uint64_t samples) {
+	return conf->mmap ? state_sync(conf, nd->map, samples, nd->dirty) : state_save(conf, nd->map, samples);
+}
+
+/* Add a replica to the map (and zero it with clear), the changed chunks are flagged in dirty. */
+static void
+add_replica(config_t* conf, uint32_t* map, uint32_t* replica, uint8_t* dirty, int clear) {
+	size_t   k, start, end;
+	uint32_t c, changed;
+	uint32_t chunks  = state_chunks(conf);
+	size_t   mapsize = (size_t) conf_map_width(conf) * conf->height * conf->iters_n;
+
+	for(c = 0; c < chunks; c++) {
+		start   = (size_t) c * STATE_CHUNK;
+		end     = (mapsize - start < STATE_CHUNK) ? mapsize : start + STATE_CHUNK;
+		changed = 0;
+		for(k = start; k < end; k++) {
+			changed |= replica[k];
+			map[k]  += replica[k];
+		}
+		if(clear) {
+			memset(replica + start, 0, sizeof(uint32_t) * (end - start));
+		}
+		if(dirty && changed) {
+			dirty[c] = 1;
+		}
+	}
+}
+
+/* Add the old replicas to the map and save it (the thread of a checkpoint). */
+static void*
+checkpoint_writer(void* _nd) {
+	int i;
+
+	/* Aliases */
+	nebula_data_t* nd   = _nd;
+	checkpoint_t*  ckpt = &(nd->ckpt);
+	config_t*      conf = ckpt->conf;
+
+	if(conf->mmap) {
+		state_dirty(conf, nd->map);
+	}
+	for(i = 0; i < nd->replicas_n; i++) {
+		add_replica(conf, nd->map, ckpt->maps[i], nd->dirty, 1);
+	}
+	ckpt->ok    = save_state(conf, nd, ckpt->samples);
+	ckpt->errsv = errno;
+	ckpt->end   = now_ns();
+
+	__atomic_store_n(&(ckpt->done), 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Start a checkpoint: Wait until all workers are paused at a jobsize boundary, so the replicas
+ * contain exactly the complete jobs, swap them with the spares and let the workers continue.
+ * The old replicas are added to the map and saved in the background.
+ */
+static void
+start_checkpoint(config_t* conf, nebula_data_t* nd) {
+	uint32_t**    maps;
+	checkpoint_t* ckpt = &(nd->ckpt);
+
+	ckpt->conf  = conf;
+	ckpt->start = now_ns();
+	ckpt->done  = 0;
+
+	pthread_mutex_lock(&(nd->pause_lock));
+	__atomic_store_n(&(nd->pause), 1, __ATOMIC_RELEASE);
+	while(nd->paused < __atomic_load_n(&(nd->workers_running), __ATOMIC_ACQUIRE)) {
+		pthread_cond_wait(&(nd->pause_cond), &(nd->pause_lock));
+	}
+
+	ckpt->samples = nd->samples_base + __atomic_load_n(&(nd->samples_done), __ATOMIC_RELAXED);
+	maps          = nd->replicas;
+	nd->replicas  = nd->spares;
+	nd->spares    = maps;
+	ckpt->maps    = maps;
+
+	__atomic_store_n(&(nd->pause), 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&(nd->pause_cond));
+	pthread_mutex_unlock(&(nd->pause_lock));
+
+	/* Without a thread, the checkpoint is written right away (and still correct). */
+	ckpt->running  = 1;
+	ckpt->threaded = (pthread_create(&(ckpt->thread), NULL, checkpoint_writer, nd) == 0);
+	if(!ckpt->threaded) {
+		checkpoint_writer(nd);
+	}
+}
+
+/* Finish the running checkpoint, if it is done (or wait for it). */
+static void
+finish_checkpoint(nebula_data_t* nd, metrics_t* metrics, int wait) {
+	double        seconds;
+	checkpoint_t* ckpt = &(nd->ckpt);
+
+	if(!ckpt->running || (!wait && !__atomic_load_n(&(ckpt->done), __ATOMIC_ACQUIRE))) {
+		return;
+	}
+	if(ckpt->threaded) {
+		pthread_join(ckpt->thread, NULL);
+	}
+	ckpt->running = 0;
+
+	if(!ckpt->ok) {
+		fprintf(stderr, "Error while saving checkpoint: %s\n", strerror(ckpt->errsv));
+		return;
+	}
+	seconds = (ckpt->end - ckpt->start) / 1e9;
+	printf("Checkpoint: %" PRIu64 " jobs saved in %.2fs\n", ckpt->samples / ckpt->conf->jobsize, seconds);
+	if(metrics) {
+		metrics->checkpoints++;
+		metrics->checkpoint_seconds = seconds;
+	}
+}
+
+/*
+ * The main thread only supervises: It forwards signals to the workers, reports the progress,
+ * writes the checkpoints and waits until the workers have run out of jobs. stats are two counter
+ * sets for the reports.
+ */
+static void
+supervise(config_t* conf, nebula_data_t* nd, worker_data_t* workers, conv_t* conv, metrics_t* metrics, stats_t* stats, uint64_t start) {
+	uint64_t        last_report  = start;
+	uint64_t        last_metrics = start;
+	uint64_t        last_ckpt    = start;
+	struct timespec last_check;
+	struct timespec interval = { 0, SUPERVISE_INTERVAL * 1000000L };
+
+	clock_gettime(CLOCK_MONOTONIC, &last_check);
+
+	while(__atomic_load_n(&(nd->workers_running), __ATOMIC_ACQUIRE) > 0) {
+		if(stop_requested) {
+			__atomic_store_n(&(nd->stop), 1, __ATOMIC_RELAXED);
+		}
+
+		if(
+		        conf->checkpoint && !nd->ckpt.running && !__atomic_load_n(&(nd->stop), __ATOMIC_RELAXED) &&
+		        (now_ns() - last_ckpt >= conf->checkpoint * 1000000000ULL) &&
+		        (__atomic_load_n(&(nd->samples_claimed), __ATOMIC_RELAXED) < nd->samples_todo)) {
+			start_checkpoint(conf, nd);
+			last_ckpt = now_ns();
+		}
+		finish_checkpoint(nd, metrics, 0);
+
+		/*
+		 * The map is read while the workers write it, the estimate doesn't need to be exact. But
+		 * it's skipped while a checkpoint adds the old replicas to the map.
+		 */
+		if(conv && !nd->ckpt.running && (elapsed_ms(&last_check) >= conf->convcheck * 1000.0)) {
+			clock_gettime(CLOCK_MONOTONIC, &last_check);
+			conv_update(conv, nd->map, nd->replicas, nd->replicas_n,
+			            nd->samples_base + __atomic_load_n(&(nd->samples_merged), __ATOMIC_ACQUIRE));
+
+			if((conf->quality > 0) && conv_done(conv, conf->quality)) {
+				printf("Quality %g reached.\n", conf->quality);
+				__atomic_store_n(&(nd->stop), 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if(progress_requested || (conf->progress && (now_ns() - last_report >= conf->progress * 1000000000ULL))) {
+			progress_requested = 0;
+			report_progress(conf, nd, workers, stats, start, &last_report);
+			if(conv) {
+				conv_print(conv, conf->quality, conf->jobsize);
+			}
+		}
+
+		if(metrics && (now_ns() - last_metrics >= conf->metricsinterval * 1000000000ULL)) {
+			last_metrics = now_ns();
+			update_metrics(conf, nd, workers, metrics);
+		}
+		nanosleep(&interval, NULL);
+	}
+}
+
+/* Stop the workers after their current job and wait for them. */
 void
-stop_workers(nebula_data_t* nd, worker_data_t* workers, int* workers_alive) {
-	int rq;
+stop_workers(nebula_data_t* nd, worker_data_t* workers, int workers_n) {
+	int i;
+
+	__atomic_store_n(&(nd->stop), 1, __ATOMIC_RELAXED);
 
-	while(*workers_alive > 0) {
-		rq = jobrq_get(nd);
-		if(rq >= 0) {
-			workers[rq].ok = 0;
-			pthread_mutex_unlock(workers[rq].mu);
-			(*workers_alive)--;
+	for(i = 0; i < workers_n; i++) {
+		/* The worker merges its shard before it exits, the map is complete after the join. */
+		if(workers[i].thread_started) {
+			pthread_join(workers[i].thread, NULL);
+			workers[i].thread_started = 0;
 		}
 	}
 }
 
+/*
+ * Allocate a set of n map replicas. calloc doesn't touch the (fresh) pages of large allocations,
+ * so they are placed on the node of the pinned worker that writes them first.
+ */
+static uint32_t**
+alloc_replicas(config_t* conf, int n) {
+	int        i;
+	uint32_t** replicas;
+	size_t     mapsize = (size_t) conf_map_width(conf) * conf->height * conf->iters_n;
+
+	if(!(replicas = calloc(n, sizeof(uint32_t*)))) {
+		return NULL;
+	}
+	for(i = 0; i < n; i++) {
+		if(!(replicas[i] = calloc(mapsize, sizeof(uint32_t)))) {
+			for(; i >= 0; i--) {
+				free(replicas[i]);
+			}
+			free(replicas);
+			return NULL;
+		}
+	}
+	return replicas;
+}
+
+/* A replica for every node (with numa=1) or a single one, and the spares for the checkpoints. */
+static int
+create_replicas(config_t* conf, nebula_data_t* nd) {
+	nd->replicas_n = conf->numa ? nd->topo->nodes_n : 1;
+	if(!(nd->replicas = alloc_replicas(conf, nd->replicas_n))) {
+		return 0;
+	}
+	if(conf->checkpoint && !(nd->spares = alloc_replicas(conf, nd->replicas_n))) {
+		return 0;
+	}
+	if(conf->mmap && !(nd->dirty = calloc(state_chunks(conf), sizeof(uint8_t)))) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Add the replicas to the map (the workers must be stopped). */
+static void
+reduce_replicas(config_t* conf, nebula_data_t* nd) {
+	int i;
+
+	for(i = 0; i < nd->replicas_n; i++) {
+		add_replica(conf, nd->map, nd->replicas[i], nd->dirty, 0);
+	}
+}
+
+/* Print the statistics collected by the (stopped) workers */
+void
+print_stats(config_t* conf, worker_data_t* workers) {
+	int      i;
+	uint64_t rejected = 0;
+	uint64_t cycles   = 0;
+	uint64_t reruns   = 0;
+	uint64_t disagree = 0;
+	uint64_t audits   = 0;
+	uint64_t missed   = 0;
+	uint64_t steps    = 0;
+	uint64_t accepted = 0;
+
+	for(i = 0; i < conf->threads; i++) {
+		if(workers[i].mh) {
+			steps    += workers[i].mh->steps;
+			accepted += workers[i].mh->accepted;
+		}
+		rejected += workers[i].orbit.rejected;
+		cycles   += workers[i].orbit.cycles;
+		reruns   += workers[i].orbit.reruns;
+		disagree += workers[i].orbit.disagree;
+		audits   += workers[i].orbit.audits;
+		missed   += workers[i].orbit.missed;
+	}
+
+	printf("Samples rejected by cardioid/bulb test: %" PRIu64 "\n", rejected);
+	printf("Orbits stopped by periodicity check: %" PRIu64 "\n", cycles);
+	if(conf->precision != PRECISION_DOUBLE) {
+		printf("Float prefilter: %" PRIu64 " samples checked in double precision, %" PRIu64 " disagreed\n", reruns, disagree);
+		printf("Float prefilter: %" PRIu64 " of %" PRIu64 " audited samples that are bounded in single precision escape in double precision\n", missed, audits);
+	}
+	if(steps > 0) {
+		printf("MH sampler: %" PRIu64 " of %" PRIu64 " proposals accepted\n", accepted, steps);
+	}
+}
+
 int
 nebula2(config_t* conf) {
 	int            rv = 1;
 	nebula_data_t* nd = NULL;
-	uint32_t       jobs_done;
+	uint64_t       samples;
 	worker_data_t* workers = NULL;
+	conv_t*        conv    = NULL;
+	metrics_t*     metrics = NULL;
+	stats_t        stats[2];
+	uint64_t       start, ns;
 	int            i;
-	int            rq;
-	int            workers_alive = 0;
+	int            regressed = 0;
 
-	if(!(nd = nebula_data_create(conf))) {
+	stats[0].escaped = NULL;
+	stats[1].escaped = NULL;
+
+	if(!(nd = nebula_data_create(conf, &samples))) {
 		goto tidyup;
 	}
-	global_nd = nd;
+	nd->samples_base = samples;
+	nd->samples_todo = (samples < (uint64_t) conf->jobs * conf->jobsize) ? (uint64_t) conf->jobs * conf->jobsize - samples : 0;
 
-	if(!state_load(conf, nd->map, &jobs_done)) {
-		fprintf(stderr, "Error while loading state: %s\n", strerror(errno));
+	if(conf->mask && !(nd->mask = mask_load(conf))) {
 		goto tidyup;
 	}
-	nd->jobs_todo = conf->jobs - jobs_done;
 
+	if(!(nd->topo = topology_detect())) {
+		fputs("Could not detect CPU topology.\n", stderr);
+		goto tidyup;
+	}
+	if(conf->threads == 0) {
+		conf->threads = nd->topo->cpus_n;
+	}
+	if(conf->numa || conf->checkpoint) {
+		if(!create_replicas(conf, nd)) {
+			fputs("Could not allocate memory for map replicas.\n", stderr);
+			goto tidyup;
+		}
+	}
+	if(conf->numa) {
+		printf("Using %d threads on %d NUMA nodes\n", conf->threads, nd->topo->nodes_n);
+	}
+
+	if((conf->convcheck > 0) && !(conv = conv_create(conf))) {
+		fputs("Could not allocate memory for noise estimation.\n", stderr);
+		goto tidyup;
+	}
+
+	if(!stats_init(stats, conf->iters_n) || !stats_init(stats + 1, conf->iters_n)) {
+		fputs("Could not allocate memory for statistics.\n", stderr);
+		goto tidyup;
+	}
+
+	if(conf->metrics[0] && !(metrics = metrics_create(conf, map_bytes(conf, nd, conv)))) {
+		fputs("Could not allocate memory for metrics.\n", stderr);
+		goto tidyup;
+	}
+
+	/* Without replicas, the workers accumulate into the mapped statefile right away. */
+	if(conf->mmap && !nd->replicas && !state_dirty(conf, nd->map)) {
+		fprintf(stderr, "Error while saving state: %s\n", strerror(errno));
+		goto tidyup;
+	}
+
+	start = now_ns();
 	if(!(workers = calloc(conf->threads, sizeof(worker_data_t)))) {
 		fputs("Could not allocate memory for worker data.\n", stderr);
 		goto tidyup;
@@ -400,7 +1177,6 @@ nebula2(config_t* conf) {
 			fputs("Could not init worker.\n", stderr);
 			goto tidyup;
 		}
-		workers_alive++;
 	}
 
 	if(!setup_sighandler()) {
@@ -408,38 +1184,78 @@ nebula2(config_t* conf) {
 		goto tidyup;
 	}
 
-	while(nd->jobs_todo > 0) {
-		rq = jobrq_get(nd);
-		if(rq < 0) {
-			break;
+	supervise(conf, nd, workers, conv, metrics, stats, start);
+	stop_workers(nd, workers, conf->threads);
+	finish_checkpoint(nd, metrics, 1);
+	print_stats(conf, workers);
+	collect_stats(conf, workers, stats);
+	stats_print(stats, NULL, (now_ns() - start) / 1e9);
+	if(nd->replicas) {
+		if(conf->mmap) {
+			state_dirty(conf, nd->map);
 		}
+		reduce_replicas(conf, nd);
+	}
+	if(conv) {
+		conv_update(conv, nd->map, NULL, 0, nd->samples_base + nd->samples_done);
+		conv_print(conv, conf->quality, conf->jobsize);
+	}
 
-		workers[rq].ok = 1;
-		(nd->jobs_todo)--;
-		pthread_mutex_unlock(workers[rq].mu);
+	if(conf->checksum || conf->reference[0]) {
+		regress_print(conf, nd->map);
+	}
+	if(conf->reference[0] && !regress_compare(conf, nd->map)) {
+		regressed = 1;
 	}
-	stop_workers(nd, workers, &workers_alive);
 
-	if(!(state_save(conf, nd->map, conf->jobs - nd->jobs_todo))) {
+	/* A stopped run can end in the middle of a jobsize unit, the statefile counts the samples. */
+	ns = now_ns();
+	if(!save_state(conf, nd, nd->samples_base + nd->samples_done)) {
 		fprintf(stderr, "Error while saving state: %s\n", strerror(errno));
 		goto tidyup;
 	}
+	if(metrics) {
+		metrics->checkpoints++;
+		metrics->checkpoint_seconds = (now_ns() - ns) / 1e9;
+		update_metrics(conf, nd, workers, metrics);
+	}
 
-	rv = render(conf, nd->map) ? 0 : 1;
-
-tidyup:
-	stop_workers(nd, workers, &workers_alive);
+	/* render changes the map, so the statefile is mapped again without writing the changes back. */
+	if(conf->mmap) {
+		state_unmap(conf, nd->map);
+		if(!(nd->map = state_map(conf, 0, &samples))) {
+			fprintf(stderr, "Error while mapping statefile: %s\n", strerror(errno));
+			goto tidyup;
+		}
+	}
 
-	if(nd) {
-		nebula_data_destroy(nd);
+	ns = now_ns();
+	rv = (render(conf, nd->map) && !regressed) ? 0 : 1;
+	if(metrics) {
+		metrics->render_seconds = (now_ns() - ns) / 1e9;
+		update_metrics(conf, nd, workers, metrics);
 	}
 
+tidyup:
 	if(workers) {
+		stop_workers(nd, workers, conf->threads);
 		for(i = 0; i < conf->threads; i++) {
 			worker_cleanup(&(workers[i]));
 		}
 		free(workers);
 	}
+
+	if(nd) {
+		nebula_data_destroy(conf, nd);
+	}
+	if(conv) {
+		conv_destroy(conv);
+	}
+	if(metrics) {
+		metrics_destroy(metrics);
+	}
+	stats_cleanup(stats);
+	stats_cleanup(stats + 1);
 	return rv;
 }
 
@@ -452,6 +1268,9 @@ main(int argc, char** argv) {
 		usage();
 		goto tidyup;
 	}
+	if(strcmp(argv[1], "merge") == 0) {
+		return merge(argc - 2, argv + 2);
+	}
 
 	if(!conf_load(argv[1], &conf)) {
 		goto tidyup;
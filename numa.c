@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "numa.h"
+
+#define NODE_DIR     "/sys/devices/system/node"
+#define NODE_CPULIST NODE_DIR "/node%d/cpulist"
+#define PATHBUF_SIZE 64
+
+/* Add CPU cpu to the topology (if we may use it and it isn't already there). */
+static void
+add_cpu(topology_t* topo, cpu_set_t* allowed, cpu_set_t* seen, int cpu, int node) {
+	if((cpu < 0) || (cpu >= CPU_SETSIZE) || !CPU_ISSET(cpu, allowed) || CPU_ISSET(cpu, seen)) {
+		return;
+	}
+	CPU_SET(cpu, seen);
+
+	topo->cpus[topo->cpus_n]  = cpu;
+	topo->nodes[topo->cpus_n] = node;
+	topo->cpus_n++;
+}
+
+/* Parse a cpulist like "0-3,8-11" and add its CPUs. */
+static void
+add_cpulist(topology_t* topo, cpu_set_t* allowed, cpu_set_t* seen, FILE* fh, int node) {
+	int  first, last, cpu;
+	char sep;
+
+	for(;; ) {
+		if(fscanf(fh, "%d", &first) != 1) {
+			return;
+		}
+		last = first;
+		sep  = fgetc(fh);
+		if(sep == '-') {
+			if(fscanf(fh, "%d", &last) != 1) {
+				return;
+			}
+			sep = fgetc(fh);
+		}
+
+		for(cpu = first; cpu <= last; cpu++) {
+			add_cpu(topo, allowed, seen, cpu, node);
+		}
+
+		if(sep != ',') {
+			return;
+		}
+	}
+}
+
+/* Highest node number in sysfs (-1, if there is no NUMA information). */
+static int
+max_node(void) {
+	DIR*           dir;
+	struct dirent* ent;
+	int            id, max = -1;
+
+	if(!(dir = opendir(NODE_DIR))) {
+		return -1;
+	}
+	while((ent = readdir(dir))) {
+		if((sscanf(ent->d_name, "node%d", &id) == 1) && (id > max)) {
+			max = id;
+		}
+	}
+	closedir(dir);
+	return max;
+}
+
+topology_t*
+topology_detect(void) {
+	topology_t* topo;
+	cpu_set_t   allowed, seen;
+	char        path[PATHBUF_SIZE];
+	FILE*       fh;
+	int         id, n, cpu, max;
+
+	if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+		return NULL;
+	}
+	CPU_ZERO(&seen);
+
+	if(!(topo = malloc(sizeof(topology_t)))) {
+		return NULL;
+	}
+	n             = CPU_COUNT(&allowed);
+	topo->nodes_n = 0;
+	topo->cpus_n  = 0;
+	topo->cpus    = malloc(sizeof(int) * n);
+	topo->nodes   = malloc(sizeof(int) * n);
+	if(!topo->cpus || !topo->nodes) {
+		topology_destroy(topo);
+		return NULL;
+	}
+
+	max = max_node();
+	for(id = 0; id <= max; id++) {
+		snprintf(path, PATHBUF_SIZE, NODE_CPULIST, id);
+		if(!(fh = fopen(path, "r"))) {
+			continue;
+		}
+
+		n = topo->cpus_n;
+		add_cpulist(topo, &allowed, &seen, fh, topo->nodes_n);
+		fclose(fh);
+
+		/* Nodes without usable CPUs (e.g. memory only) are skipped. */
+		if(topo->cpus_n > n) {
+			topo->nodes_n++;
+		}
+	}
+
+	/* CPUs sysfs didn't tell us about (or no NUMA information at all) */
+	n = topo->cpus_n;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		add_cpu(topo, &allowed, &seen, cpu, topo->nodes_n);
+	}
+	if(topo->cpus_n > n) {
+		topo->nodes_n++;
+	}
+
+	return topo;
+}
+
+void
+topology_destroy(topology_t* topo) {
+	free(topo->cpus);
+	free(topo->nodes);
+	free(topo);
+}
+
+int
+topology_node(topology_t* topo, int i) {
+	return topo->nodes[i % topo->cpus_n];
+}
+
+int
+topology_pin(topology_t* topo, int i, pthread_attr_t* attr) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(topo->cpus[i % topo->cpus_n], &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set) == 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _nebula2_numa_h_
+#define _nebula2_numa_h_
+
+#include <pthread.h>
+
+/* The CPUs we may run on, grouped by NUMA node (read from sysfs). */
+typedef struct {
+	int  nodes_n;
+	int  cpus_n;
+	int* cpus;
+	int* nodes; /* Node (0 ... nodes_n - 1) of every entry in cpus */
+} topology_t;
+
+extern topology_t* topology_detect(void);
+extern void topology_destroy(topology_t* topo);
+
+/* Worker i runs on CPU cpus[i % cpus_n], so the first workers fill the first node. */
+extern int topology_node(topology_t* topo, int i);
+
+/* Set the affinity of attr to the CPU of worker i. */
+extern int topology_pin(topology_t* topo, int i, pthread_attr_t* attr);
+
+#endif
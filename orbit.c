@@ -0,0 +1,936 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "orbit.h"
+#include "stats.h"
+
+/* Number of samples whose escape iterations are determined at once in two-phase mode. */
+#define ESCAPE_BLOCK 256
+
+/* Values in the escape array for orbits that don't escape */
+#define ESCAPE_BOUNDED -1 /* Proven to be bounded (bulb test or periodicity check) */
+#define ESCAPE_MAXITER -2 /* Did not escape before maxiter */
+
+/*
+ * A cycle found in single precision is only proof with PRECISION_FLOAT, PRECISION_MIXED checks
+ * these orbits in double precision (only the bulb test counts as proof).
+ */
+#define FLOAT_CYCLE(ctx) (((ctx)->precision == PRECISION_MIXED) ? ESCAPE_MAXITER : ESCAPE_BOUNDED)
+
+/* About one in PREFILTER_AUDIT samples that are bounded in single precision is checked in double precision. */
+#define PREFILTER_AUDIT 64
+
+/*
+ * Vector primitives for the SIMD kernel. With AVX-512 we iterate 8 orbits at once, with AVX 4 and
+ * with SSE2 2 orbits. vi is the matching int32 vector, vd_trunc converts to it.
+ */
+#if defined(__AVX512F__)
+#define LANES 8
+typedef __m512d vdouble;
+typedef __m256i vint;
+#define vd_set1(a)       _mm512_set1_pd(a)
+#define vd_loadu(p)      _mm512_loadu_pd(p)
+#define vd_storeu(p, a)  _mm512_storeu_pd(p, a)
+#define vd_add(a, b)     _mm512_add_pd(a, b)
+#define vd_sub(a, b)     _mm512_sub_pd(a, b)
+#define vd_mul(a, b)     _mm512_mul_pd(a, b)
+#define vd_gt_mask(a, b) ((int) _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ))
+#define vd_le_one(a, b)  _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(a, b, _CMP_LE_OQ), vd_set1(1.0))
+#define vd_abs(a)        _mm512_abs_pd(a)
+#define vd_max(a, b)     _mm512_max_pd(a, b)
+#define vd_lt_mask(a, b) ((int) _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ))
+#define vd_trunc(a)      _mm512_cvttpd_epi32(a)
+#define vi_set1(a)       _mm256_set1_epi32(a)
+#define vi_add(a, b)     _mm256_add_epi32(a, b)
+#define vi_or(a, b)      _mm256_or_si256(a, b)
+#define vi_gt(a, b)      _mm256_cmpgt_epi32(a, b)
+#elif defined(__AVX__)
+#define LANES 4
+typedef __m256d vdouble;
+typedef __m128i vint;
+#define vd_set1(a)       _mm256_set1_pd(a)
+#define vd_loadu(p)      _mm256_loadu_pd(p)
+#define vd_storeu(p, a)  _mm256_storeu_pd(p, a)
+#define vd_add(a, b)     _mm256_add_pd(a, b)
+#define vd_sub(a, b)     _mm256_sub_pd(a, b)
+#define vd_mul(a, b)     _mm256_mul_pd(a, b)
+#define vd_gt_mask(a, b) _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ))
+#define vd_le_one(a, b)  _mm256_and_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ), vd_set1(1.0))
+#define vd_abs(a)        _mm256_andnot_pd(vd_set1(-0.0), a)
+#define vd_max(a, b)     _mm256_max_pd(a, b)
+#define vd_lt_mask(a, b) _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ))
+#define vd_trunc(a)      _mm256_cvttpd_epi32(a)
+#elif defined(__SSE2__)
+#define LANES 2
+typedef __m128d vdouble;
+typedef __m128i vint;
+#define vd_set1(a)       _mm_set1_pd(a)
+#define vd_loadu(p)      _mm_loadu_pd(p)
+#define vd_storeu(p, a)  _mm_storeu_pd(p, a)
+#define vd_add(a, b)     _mm_add_pd(a, b)
+#define vd_sub(a, b)     _mm_sub_pd(a, b)
+#define vd_mul(a, b)     _mm_mul_pd(a, b)
+#define vd_gt_mask(a, b) _mm_movemask_pd(_mm_cmpgt_pd(a, b))
+#define vd_le_one(a, b)  _mm_and_pd(_mm_cmple_pd(a, b), vd_set1(1.0))
+#define vd_abs(a)        _mm_andnot_pd(vd_set1(-0.0), a)
+#define vd_max(a, b)     _mm_max_pd(a, b)
+#define vd_lt_mask(a, b) _mm_movemask_pd(_mm_cmplt_pd(a, b))
+#define vd_trunc(a)      _mm_cvttpd_epi32(a)
+#else
+#define LANES 1
+#endif
+
+#if (LANES == 2) || (LANES == 4)
+#define vi_set1(a)   _mm_set1_epi32(a)
+#define vi_add(a, b) _mm_add_epi32(a, b)
+#define vi_or(a, b)  _mm_or_si128(a, b)
+#define vi_gt(a, b)  _mm_cmpgt_epi32(a, b)
+#endif
+
+/* Single precision vectors for the prefilter kernel, they have twice as many lanes. */
+#if defined(__AVX512F__)
+#define FLANES 16
+typedef __m512 vfloat;
+#define vf_set1(a)       _mm512_set1_ps(a)
+#define vf_loadu(p)      _mm512_loadu_ps(p)
+#define vf_storeu(p, a)  _mm512_storeu_ps(p, a)
+#define vf_add(a, b)     _mm512_add_ps(a, b)
+#define vf_sub(a, b)     _mm512_sub_ps(a, b)
+#define vf_mul(a, b)     _mm512_mul_ps(a, b)
+#define vf_abs(a)        _mm512_abs_ps(a)
+#define vf_max(a, b)     _mm512_max_ps(a, b)
+#define vf_gt_mask(a, b) ((int) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ))
+#define vf_lt_mask(a, b) ((int) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ))
+#elif defined(__AVX__)
+#define FLANES 8
+typedef __m256 vfloat;
+#define vf_set1(a)       _mm256_set1_ps(a)
+#define vf_loadu(p)      _mm256_loadu_ps(p)
+#define vf_storeu(p, a)  _mm256_storeu_ps(p, a)
+#define vf_add(a, b)     _mm256_add_ps(a, b)
+#define vf_sub(a, b)     _mm256_sub_ps(a, b)
+#define vf_mul(a, b)     _mm256_mul_ps(a, b)
+#define vf_abs(a)        _mm256_andnot_ps(vf_set1(-0.0f), a)
+#define vf_max(a, b)     _mm256_max_ps(a, b)
+#define vf_gt_mask(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ))
+#define vf_lt_mask(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ))
+#elif defined(__SSE2__)
+#define FLANES 4
+typedef __m128 vfloat;
+#define vf_set1(a)       _mm_set1_ps(a)
+#define vf_loadu(p)      _mm_loadu_ps(p)
+#define vf_storeu(p, a)  _mm_storeu_ps(p, a)
+#define vf_add(a, b)     _mm_add_ps(a, b)
+#define vf_sub(a, b)     _mm_sub_ps(a, b)
+#define vf_mul(a, b)     _mm_mul_ps(a, b)
+#define vf_abs(a)        _mm_andnot_ps(vf_set1(-0.0f), a)
+#define vf_max(a, b)     _mm_max_ps(a, b)
+#define vf_gt_mask(a, b) _mm_movemask_ps(_mm_cmpgt_ps(a, b))
+#define vf_lt_mask(a, b) _mm_movemask_ps(_mm_cmplt_ps(a, b))
+#else
+#define FLANES 1
+#endif
+
+void
+precalc_nebula_params(config_t* conf, double* conv, double* mult_x, double* mult_y, int* hw, int* hh) {
+	*conv = ((conf->width < conf->height) ? conf->width : conf->height) / 4.0;
+
+	*mult_x = (double) (0.8 * conf->width  / *conv) / (UINT32_MAX / 2.0);
+	*mult_y = (double) (0.8 * conf->height / *conv) / (UINT32_MAX / 2.0);
+
+	*hw = conf->width / 2;
+	*hh = conf->height / 2;
+}
+
+int
+orbit_lanes(void) {
+	return LANES;
+}
+
+int
+orbit_ctx_init(orbit_ctx_t* ctx, config_t* conf, uint32_t* map) {
+	double mult_x, mult_y;
+
+	precalc_nebula_params(conf, &(ctx->conv), &mult_x, &mult_y, &(ctx->hw), &(ctx->hh));
+
+	ctx->width    = conf->width;
+	ctx->height   = conf->height;
+	ctx->mapwidth = conf_map_width(conf);
+	ctx->mapsize  = ctx->mapwidth * ctx->height;
+	ctx->symmetry = conf->symmetry;
+	ctx->layers   = conf->iters_n;
+	ctx->iters    = conf->iters;
+	ctx->maxiter  = conf->iters[conf->iters_n - 1];
+	ctx->bulbtest = conf->bulbtest;
+	ctx->twophase  = conf->twophase;
+	ctx->precision = conf->precision;
+	ctx->map       = map;
+	ctx->rejected  = 0;
+	ctx->cycles    = 0;
+	ctx->reruns    = 0;
+	ctx->disagree  = 0;
+	ctx->audits    = 0;
+	ctx->missed    = 0;
+
+	ctx->scatter_ns = 0;
+	ctx->pointlist  = NULL;
+	if(!(ctx->escaped = calloc(2 * ctx->layers, sizeof(uint64_t)))) {
+		return 0;
+	}
+	ctx->deposited = ctx->escaped + ctx->layers;
+
+	/* A disabled periodicity check never saves a point and never matches. */
+	if(conf->periodcheck > 0) {
+		ctx->period_check = conf->periodcheck;
+		ctx->period_eps   = conf->periodeps;
+	} else {
+		ctx->period_check = ctx->maxiter;
+		ctx->period_eps   = -1.0;
+	}
+
+	/* The two-phase mode, the float prefilter and the MH sampler don't record orbits. */
+	if(ctx->twophase || (ctx->precision != PRECISION_DOUBLE) || (conf->sampler == SAMPLER_MH)) {
+		return 1;
+	}
+
+	if(!(ctx->pointlist = malloc(sizeof(pos_t) * LANES * ctx->maxiter))) {
+		orbit_ctx_cleanup(ctx);
+		return 0;
+	}
+	return 1;
+}
+
+void
+orbit_ctx_cleanup(orbit_ctx_t* ctx) {
+	if(ctx->pointlist) {
+		free(ctx->pointlist);
+		ctx->pointlist = NULL;
+	}
+	if(ctx->escaped) {
+		free(ctx->escaped);
+		ctx->escaped = NULL;
+	}
+}
+
+inline static long
+fast_floor(double input) {
+	return (long) input - (input > 0 ? 0 : 1);
+}
+
+inline static void
+calc_mandelbrot(double cx, double cy, double* zx, double* zy) {
+	double ty;
+	ty  = (*zy) * (*zy) - (*zx) * (*zx) + cy;
+	*zx = 2.0 * (*zy) * (*zx) + cx;
+	*zy = ty;
+}
+
+inline static pos_t
+calc_pos(double zx, double zy, size_t width, size_t height, double conv, int hw, int hh) {
+	pos_t rv;
+	rv.x = fast_floor(zx * conv) + hw;
+	rv.y = fast_floor(zy * conv) + hh;
+
+	if((rv.x < 0) || (rv.y < 0) || (rv.x >= width) || (rv.y >= height)) {
+		rv.x = -1;
+	}
+
+	return rv;
+}
+
+/*
+ * Is c in the main cardioid or the period-2 bulb? These points never escape, so we don't need to
+ * iterate them. Note that cy is the real and cx the imaginary part of c (see calc_mandelbrot).
+ */
+inline static int
+in_main_bulbs(double cx, double cy) {
+	double q, re;
+
+	re = cy - 0.25;
+	q  = re * re + cx * cx;
+	if(q * (q + re) <= 0.25 * cx * cx) {
+		return 1;
+	}
+
+	re = cy + 1.0;
+	return (re * re + cx * cx) <= 0.0625;
+}
+
+/* Should the sample be skipped? Counts the rejected samples. */
+inline static int
+reject(orbit_ctx_t* ctx, double cx, double cy) {
+	if(ctx->bulbtest && in_main_bulbs(cx, cy)) {
+		ctx->rejected++;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Add weight to the pixel at pos of the layer starting at off. With symmetry, the mirrored pixel
+ * is updated, too (or instead, if pos is in the right half of a folded map).
+ */
+inline static void
+plot(orbit_ctx_t* ctx, size_t off, pos_t pos, uint32_t weight) {
+	size_t row = off + ctx->mapwidth * pos.y;
+
+	switch(ctx->symmetry) {
+	case SYMMETRY_MIRROR:
+		ctx->map[row + ctx->width - 1 - pos.x] += weight;
+		break;
+	case SYMMETRY_FOLD:
+		if(pos.x >= ctx->mapwidth) {
+			pos.x = ctx->width - 1 - pos.x;
+		}
+		break;
+	}
+	ctx->map[row + pos.x] += weight;
+}
+
+/* Scatter the recorded points of an orbit that escaped at iteration iter into the map. */
+inline static void
+deposit(orbit_ctx_t* ctx, pos_t* pointlist, int iter, uint32_t weight) {
+	int      mii;
+	size_t   off;
+	pos_t    pos;
+	uint64_t n = 0;
+
+	for(mii = 0; iter > ctx->iters[mii]; mii++) {}
+	off = mii * ctx->mapsize;
+	ctx->escaped[mii]++;
+
+	pointlist += iter + 1;
+	do {
+		/*
+		 * To be 100% accurate, we would need to synchronize the access to the map here.
+		 * We ignore this, since collision should be seldom.
+		 */
+		pos = *(--pointlist);
+		if(pos.x < 0) {
+			continue;
+		}
+		plot(ctx, off, pos, weight);
+		n++;
+	} while(iter-- > 0);
+	ctx->deposited[mii] += n;
+}
+
+/*
+ * Periodicity checking (Brent's algorithm): We save z after iteration save_at and compare all
+ * following points with it. If the orbit comes back to the saved point (within period_eps), it is
+ * caught in a cycle and will never escape. Every time we save, the distance to the next save is
+ * doubled, so we will eventually find cycles of any length.
+ */
+inline static int
+next_save(int save_at, int* save_int) {
+	save_at    += *save_int;
+	*save_int <<= 1;
+	return save_at;
+}
+
+/*
+ * Replay an orbit that escaped at iteration iter (second phase of the two-phase mode) and scatter
+ * its points directly into the map, each with the given weight.
+ */
+static void
+replay(orbit_ctx_t* ctx, double cx, double cy, int iter, uint32_t weight) {
+	int      i, mii;
+	size_t   off;
+	double   zx, zy;
+	pos_t    pos;
+	uint64_t n = 0;
+
+	for(mii = 0; iter > ctx->iters[mii]; mii++) {}
+	off = mii * ctx->mapsize;
+	ctx->escaped[mii]++;
+
+	zx = zy = .0;
+	for(i = 0; i <= iter; i++) {
+		calc_mandelbrot(cx, cy, &zx, &zy);
+		pos = calc_pos(zx, zy, ctx->width, ctx->height, ctx->conv, ctx->hw, ctx->hh);
+		if(pos.x < 0) {
+			continue;
+		}
+		/* Same as in deposit(): We ignore collisions. */
+		plot(ctx, off, pos, weight);
+		n++;
+	}
+	ctx->deposited[mii] += n;
+}
+
+/*
+ * The kernels run in one of two modes: If escape is NULL, every point of an orbit is recorded in
+ * the pointlist and escaping orbits are scattered right away. Otherwise (first phase of the
+ * two-phase mode) nothing is recorded, the escape iteration of sample i (or one of the ESCAPE_*
+ * values, if it does not escape) is written to escape[i].
+ */
+inline static void
+trace_scalar(orbit_ctx_t* ctx, const double* cx, const double* cy, size_t n, int* escape, uint32_t weight) {
+	size_t i;
+	int    iter, save_at, save_int;
+	double zx, zy, sx, sy;
+	pos_t* pointlist = ctx->pointlist;
+	double eps       = ctx->period_eps;
+
+	for(i = 0; i < n; i++) {
+		if(escape) {
+			escape[i] = ESCAPE_MAXITER;
+		}
+		if(reject(ctx, cx[i], cy[i])) {
+			if(escape) {
+				escape[i] = ESCAPE_BOUNDED;
+			}
+			continue;
+		}
+
+		zx = zy = .0;
+		sx = sy = .0;
+
+		save_at  = ctx->period_check;
+		save_int = ctx->period_check;
+
+		for(iter = 0; iter < ctx->maxiter; iter++) {
+			calc_mandelbrot(cx[i], cy[i], &zx, &zy);
+			if(!escape) {
+				pointlist[iter] = calc_pos(zx, zy, ctx->width, ctx->height, ctx->conv, ctx->hw, ctx->hh);
+			}
+			if((zx * zx) + (zy * zy) > BAILOUT) {
+				if(escape) {
+					escape[i] = iter;
+				} else {
+					deposit(ctx, pointlist, iter, weight);
+				}
+				break;
+			}
+
+			if((fabs(zx - sx) < eps) && (fabs(zy - sy) < eps)) {
+				if(escape) {
+					escape[i] = ESCAPE_BOUNDED;
+				}
+				ctx->cycles++;
+				break;
+			}
+			if(iter == save_at) {
+				sx      = zx;
+				sy      = zy;
+				save_at = next_save(save_at, &save_int);
+			}
+		}
+	}
+}
+
+#if LANES > 1
+
+/* Store the positions of all lanes as pos_t values */
+inline static void
+vstore_pos(pos_t* out, vint ix, vint iy) {
+#if LANES == 8
+	__m256i lo = _mm256_unpacklo_epi32(ix, iy);
+	__m256i hi = _mm256_unpackhi_epi32(ix, iy);
+	_mm256_storeu_si256((__m256i*) out,       _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i*) (out + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+#else
+	_mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi32(ix, iy));
+#if LANES == 4
+	_mm_storeu_si128((__m128i*) (out + 2), _mm_unpackhi_epi32(ix, iy));
+#endif
+#endif
+}
+
+/*
+ * Vectorized calc_pos for all lanes. Computes exactly what calc_pos computes: fast_floor(v) is
+ * trunc(v - (v <= 0 ? 1 : 0)) for the (small) values we get here.
+ */
+inline static void
+vcalc_pos(vdouble zx, vdouble zy, vdouble conv, vint hw, vint hh, vint wmax, vint hmax, pos_t* out) {
+	vdouble px, py;
+	vint    ix, iy, inv;
+	vdouble zero  = vd_set1(0.0);
+	vint    izero = vi_set1(0);
+
+	px = vd_mul(zx, conv);
+	py = vd_mul(zy, conv);
+	ix = vi_add(vd_trunc(vd_sub(px, vd_le_one(px, zero))), hw);
+	iy = vi_add(vd_trunc(vd_sub(py, vd_le_one(py, zero))), hh);
+
+	inv = vi_or(
+	        vi_or(vi_gt(izero, ix), vi_gt(ix, wmax)),
+	        vi_or(vi_gt(izero, iy), vi_gt(iy, hmax)));
+	ix = vi_or(ix, inv);
+
+	vstore_pos(out, ix, iy);
+}
+
+/*
+ * Iterates LANES orbits at once. A lane is retired as soon as its orbit escapes (then it gets
+ * scattered), is caught in a cycle or reaches maxiter, and is refilled with the next sample.
+ * Lanes without work iterate c = 0, which never escapes (their cycles are masked out).
+ * Each round of iterations ends when a lane needs attention: it escaped, got caught in a cycle,
+ * reached maxiter or its periodicity check point must be saved.
+ * For the meaning of escape, see trace_scalar.
+ */
+inline static void
+trace_simd(orbit_ctx_t* ctx, const double* cx, const double* cy, size_t n, int* escape, uint32_t weight) {
+	double lane_cx[LANES], lane_cy[LANES], lane_zx[LANES], lane_zy[LANES];
+	double lane_sx[LANES], lane_sy[LANES];
+	size_t lane_i[LANES];
+	int    iter[LANES];
+	int    save_at[LANES], save_int[LANES];
+	int    busy[LANES];
+	pos_t* lp[LANES];
+	pos_t  posbuf[LANES];
+	size_t next = 0;
+	int    l, s, steps, mask, cycmask, busymask, active;
+	int    maxiter = ctx->maxiter;
+
+	vdouble vcx, vcy, vzx, vzy, vzx2, vzy2, vsx, vsy, ty;
+	vdouble eps     = vd_set1(ctx->period_eps);
+	vdouble two     = vd_set1(2.0);
+	vdouble bailout = vd_set1(BAILOUT);
+	vdouble conv    = vd_set1(ctx->conv);
+	vint    hw      = vi_set1(ctx->hw);
+	vint    hh      = vi_set1(ctx->hh);
+	vint    wmax    = vi_set1(ctx->width - 1);
+	vint    hmax    = vi_set1(ctx->height - 1);
+
+	for(l = 0; l < LANES; l++) {
+		busy[l] = 0;
+		lp[l]   = ctx->pointlist;
+	}
+
+	for(;; ) {
+		/* (Re)fill lanes and find out, how many steps we can do before a lane needs attention. */
+		active   = 0;
+		busymask = 0;
+		steps    = maxiter;
+		for(l = 0; l < LANES; l++) {
+			if(!busy[l]) {
+				lane_zx[l]  = lane_zy[l] = .0;
+				lane_sx[l]  = lane_sy[l] = .0;
+				iter[l]     = 0;
+				save_at[l]  = ctx->period_check;
+				save_int[l] = ctx->period_check;
+				lp[l]       = escape ? NULL : ctx->pointlist + l * maxiter;
+				for(; next < n; next++) {
+					if(!reject(ctx, cx[next], cy[next])) {
+						break;
+					}
+					if(escape) {
+						escape[next] = ESCAPE_BOUNDED;
+					}
+				}
+				if(next < n) {
+					if(escape) {
+						escape[next] = ESCAPE_MAXITER;
+					}
+					lane_cx[l] = cx[next];
+					lane_cy[l] = cy[next];
+					lane_i[l]  = next;
+					busy[l]    = 1;
+					next++;
+				} else {
+					lane_cx[l] = lane_cy[l] = .0;
+					continue;
+				}
+			}
+			active    = 1;
+			busymask |= 1 << l;
+			if(maxiter - iter[l] < steps) {
+				steps = maxiter - iter[l];
+			}
+			if(save_at[l] - iter[l] + 1 < steps) {
+				steps = save_at[l] - iter[l] + 1;
+			}
+		}
+		if(!active) {
+			break;
+		}
+
+		vcx  = vd_loadu(lane_cx);
+		vcy  = vd_loadu(lane_cy);
+		vzx  = vd_loadu(lane_zx);
+		vzy  = vd_loadu(lane_zy);
+		vsx  = vd_loadu(lane_sx);
+		vsy  = vd_loadu(lane_sy);
+		vzx2 = vd_mul(vzx, vzx);
+		vzy2 = vd_mul(vzy, vzy);
+
+		mask    = 0;
+		cycmask = 0;
+		for(s = 0; s < steps; ) {
+			ty  = vd_add(vd_sub(vzy2, vzx2), vcy);
+			vzx = vd_add(vd_mul(vd_mul(two, vzy), vzx), vcx);
+			vzy = ty;
+
+			if(!escape) {
+				vcalc_pos(vzx, vzy, conv, hw, hh, wmax, hmax, posbuf);
+				for(l = 0; l < LANES; l++) {
+					*(lp[l]++) = posbuf[l];
+				}
+			}
+
+			vzx2 = vd_mul(vzx, vzx);
+			vzy2 = vd_mul(vzy, vzy);
+			s++;
+			mask    = vd_gt_mask(vd_add(vzx2, vzy2), bailout);
+			cycmask = vd_lt_mask(vd_max(vd_abs(vd_sub(vzx, vsx)), vd_abs(vd_sub(vzy, vsy))), eps) & busymask;
+			if(mask | cycmask) {
+				break;
+			}
+		}
+
+		vd_storeu(lane_zx, vzx);
+		vd_storeu(lane_zy, vzy);
+
+		for(l = 0; l < LANES; l++) {
+			if(!busy[l]) {
+				continue;
+			}
+			iter[l] += s;
+			if(mask & (1 << l)) {
+				if(escape) {
+					escape[lane_i[l]] = iter[l] - 1;
+				} else {
+					deposit(ctx, ctx->pointlist + l * maxiter, iter[l] - 1, weight);
+				}
+				busy[l] = 0;
+			} else if(cycmask & (1 << l)) {
+				if(escape) {
+					escape[lane_i[l]] = ESCAPE_BOUNDED;
+				}
+				ctx->cycles++;
+				busy[l] = 0;
+			} else if(iter[l] >= maxiter) {
+				busy[l] = 0;
+			} else if(iter[l] - 1 == save_at[l]) {
+				lane_sx[l] = lane_zx[l];
+				lane_sy[l] = lane_zy[l];
+				save_at[l] = next_save(save_at[l], &(save_int[l]));
+			}
+		}
+	}
+}
+
+#endif
+
+/*
+ * Single precision variant of trace_scalar for the prefilter. Only determines escape iterations.
+ */
+static void
+escape_scalar_float(orbit_ctx_t* ctx, const double* cx, const double* cy, size_t n, int* escape) {
+	size_t i;
+	int    iter, save_at, save_int;
+	float  fcx, fcy, zx, zy, sx, sy, ty;
+	float  eps = ctx->period_eps;
+
+	for(i = 0; i < n; i++) {
+		escape[i] = ESCAPE_MAXITER;
+		if(reject(ctx, cx[i], cy[i])) {
+			escape[i] = ESCAPE_BOUNDED;
+			continue;
+		}
+
+		fcx = cx[i];
+		fcy = cy[i];
+		zx  = zy = .0f;
+		sx  = sy = .0f;
+
+		save_at  = ctx->period_check;
+		save_int = ctx->period_check;
+
+		for(iter = 0; iter < ctx->maxiter; iter++) {
+			ty = zy * zy - zx * zx + fcy;
+			zx = 2.0f * zy * zx + fcx;
+			zy = ty;
+			if((zx * zx) + (zy * zy) > BAILOUT) {
+				escape[i] = iter;
+				break;
+			}
+
+			if((fabsf(zx - sx) < eps) && (fabsf(zy - sy) < eps)) {
+				escape[i] = FLOAT_CYCLE(ctx);
+				ctx->cycles++;
+				break;
+			}
+			if(iter == save_at) {
+				sx      = zx;
+				sy      = zy;
+				save_at = next_save(save_at, &save_int);
+			}
+		}
+	}
+}
+
+#if FLANES > 1
+
+/*
+ * Single precision variant of trace_simd for the prefilter. Only determines escape iterations.
+ */
+static void
+escape_simd_float(orbit_ctx_t* ctx, const double* cx, const double* cy, size_t n, int* escape) {
+	float  lane_cx[FLANES], lane_cy[FLANES], lane_zx[FLANES], lane_zy[FLANES];
+	float  lane_sx[FLANES], lane_sy[FLANES];
+	size_t lane_i[FLANES];
+	int    iter[FLANES];
+	int    save_at[FLANES], save_int[FLANES];
+	int    busy[FLANES];
+	size_t next = 0;
+	int    l, s, steps, mask, cycmask, busymask, active;
+	int    maxiter = ctx->maxiter;
+
+	vfloat vcx, vcy, vzx, vzy, vzx2, vzy2, vsx, vsy, ty;
+	vfloat eps     = vf_set1(ctx->period_eps);
+	vfloat two     = vf_set1(2.0f);
+	vfloat bailout = vf_set1(BAILOUT);
+
+	for(l = 0; l < FLANES; l++) {
+		busy[l] = 0;
+	}
+
+	for(;; ) {
+		active   = 0;
+		busymask = 0;
+		steps    = maxiter;
+		for(l = 0; l < FLANES; l++) {
+			if(!busy[l]) {
+				lane_zx[l]  = lane_zy[l] = .0f;
+				lane_sx[l]  = lane_sy[l] = .0f;
+				iter[l]     = 0;
+				save_at[l]  = ctx->period_check;
+				save_int[l] = ctx->period_check;
+				for(; next < n; next++) {
+					if(!reject(ctx, cx[next], cy[next])) {
+						break;
+					}
+					escape[next] = ESCAPE_BOUNDED;
+				}
+				if(next < n) {
+					escape[next] = ESCAPE_MAXITER;
+					lane_cx[l]   = cx[next];
+					lane_cy[l]   = cy[next];
+					lane_i[l]    = next;
+					busy[l]      = 1;
+					next++;
+				} else {
+					lane_cx[l] = lane_cy[l] = .0f;
+					continue;
+				}
+			}
+			active    = 1;
+			busymask |= 1 << l;
+			if(maxiter - iter[l] < steps) {
+				steps = maxiter - iter[l];
+			}
+			if(save_at[l] - iter[l] + 1 < steps) {
+				steps = save_at[l] - iter[l] + 1;
+			}
+		}
+		if(!active) {
+			break;
+		}
+
+		vcx  = vf_loadu(lane_cx);
+		vcy  = vf_loadu(lane_cy);
+		vzx  = vf_loadu(lane_zx);
+		vzy  = vf_loadu(lane_zy);
+		vsx  = vf_loadu(lane_sx);
+		vsy  = vf_loadu(lane_sy);
+		vzx2 = vf_mul(vzx, vzx);
+		vzy2 = vf_mul(vzy, vzy);
+
+		mask    = 0;
+		cycmask = 0;
+		for(s = 0; s < steps; ) {
+			ty  = vf_add(vf_sub(vzy2, vzx2), vcy);
+			vzx = vf_add(vf_mul(vf_mul(two, vzy), vzx), vcx);
+			vzy = ty;
+
+			vzx2 = vf_mul(vzx, vzx);
+			vzy2 = vf_mul(vzy, vzy);
+			s++;
+			mask    = vf_gt_mask(vf_add(vzx2, vzy2), bailout);
+			cycmask = vf_lt_mask(vf_max(vf_abs(vf_sub(vzx, vsx)), vf_abs(vf_sub(vzy, vsy))), eps) & busymask;
+			if(mask | cycmask) {
+				break;
+			}
+		}
+
+		vf_storeu(lane_zx, vzx);
+		vf_storeu(lane_zy, vzy);
+
+		for(l = 0; l < FLANES; l++) {
+			if(!busy[l]) {
+				continue;
+			}
+			iter[l] += s;
+			if(mask & (1 << l)) {
+				escape[lane_i[l]] = iter[l] - 1;
+				busy[l]           = 0;
+			} else if(cycmask & (1 << l)) {
+				escape[lane_i[l]] = FLOAT_CYCLE(ctx);
+				ctx->cycles++;
+				busy[l] = 0;
+			} else if(iter[l] >= maxiter) {
+				busy[l] = 0;
+			} else if(iter[l] - 1 == save_at[l]) {
+				lane_sx[l] = lane_zx[l];
+				lane_sy[l] = lane_zy[l];
+				save_at[l] = next_save(save_at[l], &(save_int[l]));
+			}
+		}
+	}
+}
+
+#endif
+
+static void
+trace(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, int* escape, uint32_t weight) {
+#if LANES > 1
+	if(kernel == KERNEL_SIMD) {
+		trace_simd(ctx, cx, cy, n, escape, weight);
+		return;
+	}
+#endif
+	trace_scalar(ctx, cx, cy, n, escape, weight);
+}
+
+static void
+escape_float(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, int* escape) {
+#if FLANES > 1
+	if(kernel == KERNEL_SIMD) {
+		escape_simd_float(ctx, cx, cy, n, escape);
+		return;
+	}
+#endif
+	escape_scalar_float(ctx, cx, cy, n, escape);
+}
+
+inline static int
+layer_of(orbit_ctx_t* ctx, int iter) {
+	int mii;
+
+	if(iter < 0) {
+		return -1;
+	}
+	for(mii = 0; iter > ctx->iters[mii]; mii++) {}
+	return mii;
+}
+
+/*
+ * Is the sample bounded in single precision one of the audited ones? This only depends on c (not
+ * on the order of the samples), so runs with a fixed seed stay reproducible.
+ */
+static int
+audited(double cx, double cy) {
+	uint64_t bx, by;
+
+	memcpy(&bx, &cx, sizeof(bx));
+	memcpy(&by, &cy, sizeof(by));
+	return ((((bx ^ (by << 32) ^ (by >> 32)) * 0x9e3779b97f4a7c15ULL) >> 32) % PREFILTER_AUDIT) == 0;
+}
+
+/*
+ * The float prefilter: Classify a block of samples in single precision first. Orbits that escape
+ * in single precision (and with PRECISION_MIXED also the ones that were not proven to be bounded)
+ * are iterated again in double precision, only these results are scattered. A sample of the other
+ * orbits is audited in double precision, too, to count the escapes single precision misses.
+ */
+static void
+prefilter(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, uint32_t weight) {
+	int      fescape[ESCAPE_BLOCK], descape[ESCAPE_BLOCK];
+	double   ccx[ESCAPE_BLOCK], ccy[ESCAPE_BLOCK];
+	char     audit[ESCAPE_BLOCK];
+	size_t   i, m, nc, done;
+	uint64_t start, cycles;
+
+	for(done = 0; done < n; done += m) {
+		m = ((n - done) < ESCAPE_BLOCK) ? (n - done) : ESCAPE_BLOCK;
+
+		escape_float(ctx, kernel, cx + done, cy + done, m, fescape);
+
+		nc = 0;
+		for(i = 0; i < m; i++) {
+			if((fescape[i] >= 0) || ((ctx->precision == PRECISION_MIXED) && (fescape[i] == ESCAPE_MAXITER))) {
+				audit[nc] = 0;
+				ctx->reruns++;
+			} else if(audited(cx[done + i], cy[done + i])) {
+				audit[nc] = 1;
+			} else {
+				continue;
+			}
+			ccx[nc]     = cx[done + i];
+			ccy[nc]     = cy[done + i];
+			fescape[nc] = fescape[i];
+			nc++;
+		}
+
+		/* The cycles of the reruns were already counted in single precision. */
+		cycles = ctx->cycles;
+		trace(ctx, kernel, ccx, ccy, nc, descape, 0);
+		ctx->cycles = cycles;
+
+		start = now_ns();
+		for(i = 0; i < nc; i++) {
+			if(audit[i]) {
+				ctx->audits++;
+				ctx->missed += (descape[i] >= 0);
+			} else if(layer_of(ctx, fescape[i]) != layer_of(ctx, descape[i])) {
+				ctx->disagree++;
+			}
+			if(descape[i] >= 0) {
+				replay(ctx, ccx[i], ccy[i], descape[i], weight);
+			}
+		}
+		ctx->scatter_ns += now_ns() - start;
+	}
+}
+
+void
+orbit_trace(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, uint32_t weight) {
+	int      escape[ESCAPE_BLOCK];
+	size_t   i, m, done;
+	uint64_t start;
+
+	if(ctx->precision != PRECISION_DOUBLE) {
+		prefilter(ctx, kernel, cx, cy, n, weight);
+		return;
+	}
+
+	if(!ctx->twophase) {
+		trace(ctx, kernel, cx, cy, n, NULL, weight);
+		return;
+	}
+
+	for(done = 0; done < n; done += m) {
+		m = ((n - done) < ESCAPE_BLOCK) ? (n - done) : ESCAPE_BLOCK;
+
+		trace(ctx, kernel, cx + done, cy + done, m, escape, 0);
+
+		start = now_ns();
+		for(i = 0; i < m; i++) {
+			if(escape[i] >= 0) {
+				replay(ctx, cx[done + i], cy[done + i], escape[i], weight);
+			}
+		}
+		ctx->scatter_ns += now_ns() - start;
+	}
+}
+
+void
+orbit_escape(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, int* escape) {
+	trace(ctx, kernel, cx, cy, n, escape, 0);
+}
+
+void
+orbit_scatter(orbit_ctx_t* ctx, double cx, double cy, int iter, uint32_t weight) {
+	replay(ctx, cx, cy, iter, weight);
+}
@@ -0,0 +1,88 @@
+#ifndef _nebula2_orbit_h_
+#define _nebula2_orbit_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Bailout is currently hard coded... perhaps we should move this to the config file? */
+#define BAILOUT 8
+
+typedef struct {
+	int x, y;
+} pos_t;
+
+/* Everything an orbit kernel needs to trace orbits and scatter them into the map. */
+typedef struct {
+	/* Precalculated data (scaling factors etc.) */
+	double conv;
+	int    hw, hh;
+	size_t width, height, mapsize;
+	size_t mapwidth; /* Stored columns per row, see conf_map_width() */
+	int    symmetry;
+	int    layers;
+
+	int* iters;
+	int  maxiter;
+	int  bulbtest;
+	int  twophase;
+	int  precision;
+
+	/* Periodicity checking, see next_save() in orbit.c */
+	int    period_check;
+	double period_eps;
+
+	uint32_t* map;
+
+	/* orbit_lanes() * maxiter entries, one list per lane (NULL in two-phase mode). */
+	pos_t* pointlist;
+
+	/* Statistics */
+	uint64_t rejected; /* Samples skipped, because they are in the main cardioid or period-2 bulb. */
+	uint64_t cycles;   /* Orbits stopped early by the periodicity check (in single precision with the prefilter). */
+	uint64_t reruns;   /* Samples of the float prefilter that were iterated again in double precision (without the audits). */
+	uint64_t disagree; /* Reruns where double precision gave a different layer (or no escape). */
+	uint64_t audits;   /* Reruns of samples that are bounded in single precision (see prefilter()) */
+	uint64_t missed;   /* Audits where the orbit escapes in double precision */
+
+	uint64_t* escaped;    /* Scattered orbits of every layer */
+	uint64_t* deposited;  /* Points scattered into every layer (allocated together with escaped) */
+	uint64_t  scatter_ns; /* Time of the scatter phase (two-phase mode and prefilter only, see stats.h) */
+} orbit_ctx_t;
+
+extern void precalc_nebula_params(config_t* conf, double* conv, double* mult_x, double* mult_y, int* hw, int* hh);
+
+/* Map 64 random bits to a point c of the sampled rectangle (see precalc_nebula_params). */
+inline static void
+random_to_c(uint64_t xy, double mult_x, double mult_y, double* cx, double* cy) {
+	*cx = ((int32_t) (xy >> 32)) * mult_x;
+	*cy = ((int32_t) (xy & UINT32_MAX)) * mult_y;
+}
+
+/* Number of samples the SIMD kernel iterates at once (1, if compiled without SIMD support). */
+extern int orbit_lanes(void);
+
+extern int orbit_ctx_init(orbit_ctx_t* ctx, config_t* conf, uint32_t* map);
+extern void orbit_ctx_cleanup(orbit_ctx_t* ctx);
+
+/*
+ * Trace the orbits of n samples and scatter the escaping ones into the map, every point counts
+ * weight times.
+ * In two-phase mode, the orbits are first iterated without recording them to find the escape
+ * iteration. Only escaping orbits are then iterated again to scatter their points.
+ * With the float prefilter (precision is not PRECISION_DOUBLE), the first phase is done in single
+ * precision and candidates are checked again in double precision before they are scattered.
+ */
+extern void orbit_trace(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, uint32_t weight);
+
+/*
+ * Only determine the escape iterations of n samples (in double precision). For orbits that don't
+ * escape, escape[i] is negative.
+ */
+extern void orbit_escape(orbit_ctx_t* ctx, int kernel, const double* cx, const double* cy, size_t n, int* escape);
+
+/* Scatter the orbit of c, that escaped at iteration iter, into the map. Every point counts weight times. */
+extern void orbit_scatter(orbit_ctx_t* ctx, double cx, double cy, int iter, uint32_t weight);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "config.h"
+#include "statefile.h"
+#include "regress.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+uint64_t
+map_checksum(uint32_t* map, size_t n) {
+	size_t   i;
+	int      b;
+	uint64_t h = FNV_OFFSET;
+
+	for(i = 0; i < n; i++) {
+		for(b = 0; b < 32; b += 8) {
+			h ^= (map[i] >> b) & 0xff;
+			h *= FNV_PRIME;
+		}
+	}
+	return h;
+}
+
+void
+regress_print(config_t* conf, uint32_t* map) {
+	int       l;
+	size_t    i;
+	uint64_t  sum, hit;
+	uint32_t  max;
+	uint32_t* layer;
+	size_t    layersize = (size_t) conf_map_width(conf) * conf->height;
+
+	printf("Map checksum: %016" PRIx64 "\n", map_checksum(map, layersize * conf->iters_n));
+
+	for(l = 0; l < conf->iters_n; l++) {
+		layer = map + l * layersize;
+		sum   = 0;
+		hit   = 0;
+		max   = 0;
+		for(i = 0; i < layersize; i++) {
+			sum += layer[i];
+			hit += (layer[i] > 0);
+			max  = (layer[i] > max) ? layer[i] : max;
+		}
+		printf("Layer %d: %" PRIu64 " points, %" PRIu64 " of %zu pixels hit, max %" PRIu32 "\n", l, sum, hit, layersize, max);
+	}
+}
+
+/* Number of pixels of the layer that differ from the reference layer */
+static uint64_t
+differences(config_t* conf, uint32_t* layer, uint32_t* ref) {
+	size_t   i;
+	uint64_t n      = 0;
+	size_t   pixels = (size_t) conf->width * conf->height;
+
+	for(i = 0; i < pixels; i++) {
+		n += (layer[conf_map_index(conf, i)] != ref[i]);
+	}
+	return n;
+}
+
+/* L1 distance of the normalized layer and the normalized reference layer */
+static double
+distance(config_t* conf, uint32_t* layer, uint32_t* ref) {
+	size_t i;
+	double sa     = 0, sb = 0, d = 0;
+	size_t pixels = (size_t) conf->width * conf->height;
+
+	for(i = 0; i < pixels; i++) {
+		sa += layer[conf_map_index(conf, i)];
+		sb += ref[i];
+	}
+	if((sa == 0) || (sb == 0)) {
+		return (sa == sb) ? 0 : 2;
+	}
+
+	for(i = 0; i < pixels; i++) {
+		d += fabs(layer[conf_map_index(conf, i)] / sa - ref[i] / sb);
+	}
+	return d;
+}
+
+int
+regress_compare(config_t* conf, uint32_t* map) {
+	config_t  refconf = *conf;
+	config_t* refsettings;
+	uint32_t* ref     = NULL;
+	uint64_t  samples;
+	uint64_t  n;
+	double    d;
+	int       l, rv = 0;
+	size_t    layersize = (size_t) conf_map_width(conf) * conf->height;
+	size_t    pixels    = (size_t) conf->width * conf->height;
+
+	refconf.statefile = conf->reference;
+	refconf.symmetry  = SYMMETRY_OFF;
+
+	/* The reference may have been made with another sampler or mask (and settings). */
+	if(!state_config(conf->reference, &refsettings)) {
+		fprintf(stderr, "Error while loading reference statefile: %s\n", strerror(errno));
+		goto tidyup;
+	}
+	refconf.sampler    = refsettings->sampler;
+	refconf.mask       = refsettings->mask;
+	refconf.mhlayer    = refsettings->mhlayer;
+	refconf.mhboost    = refsettings->mhboost;
+	refconf.maskres    = refsettings->maskres;
+	refconf.maskweight = refsettings->maskweight;
+	conf_destroy(refsettings);
+
+	if(!(ref = malloc(sizeof(uint32_t) * pixels * conf->iters_n))) {
+		fputs("Could not allocate memory for reference map.\n", stderr);
+		goto tidyup;
+	}
+	if(!state_load(&refconf, ref, &samples)) {
+		fprintf(stderr, "Error while loading reference statefile: %s\n", strerror(errno));
+		goto tidyup;
+	}
+	if(samples == 0) {
+		fprintf(stderr, "Reference statefile %s is missing or empty.\n", conf->reference);
+		goto tidyup;
+	}
+
+	rv = 1;
+	for(l = 0; l < conf->iters_n; l++) {
+		if(conf->reftolerance == 0) {
+			n = differences(conf, map + l * layersize, ref + l * pixels);
+			printf("Layer %d: %" PRIu64 " pixels differ from the reference\n", l, n);
+			rv = rv && (n == 0);
+		} else {
+			d = distance(conf, map + l * layersize, ref + l * pixels);
+			printf("Layer %d: distance %.4f to the reference (tolerance %g)\n", l, d, conf->reftolerance);
+			rv = rv && (d <= conf->reftolerance);
+		}
+	}
+	puts(rv ? "Reference comparison passed." : "Reference comparison FAILED.");
+
+tidyup:
+	free(ref);
+	return rv;
+}
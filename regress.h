@@ -0,0 +1,28 @@
+#ifndef _nebula2_regress_h_
+#define _nebula2_regress_h_
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Regression checks: A run with a fixed seed (rng=philox or sampler=sobol) is reproducible, so its
+ * map checksum can be compared with a known one. Paths that calculate the same distribution in a
+ * different way (SIMD, float prefilter, symmetry, ...) are compared with a reference statefile by
+ * the L1 distance of the normalized layers instead.
+ */
+
+/* FNV-1a hash of the map values (independent of the byte order) */
+extern uint64_t map_checksum(uint32_t* map, size_t n);
+
+/* Print the checksum of the map and the statistics of every layer. */
+extern void regress_print(config_t* conf, uint32_t* map);
+
+/*
+ * Compare the map with the reference statefile (conf->reference, which must have the same size and
+ * iterations and can't use symmetry=fold). With reftolerance = 0, the maps must be identical,
+ * otherwise the distance of every layer must be at most reftolerance. Returns 1 if they match.
+ */
+extern int regress_compare(config_t* conf, uint32_t* map);
+
+#endif
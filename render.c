@@ -14,7 +14,7 @@ add_submaps(config_t* conf, uint32_t* map) {
 	int    i, j;
 	size_t k, mapsize, off_i, off_j;
 
-	mapsize = conf->width * conf->height;
+	mapsize = (size_t) conf_map_width(conf) * conf->height;
 
 	for(i = conf->iters_n - 1; i <= 0; i--) {
 		off_i = mapsize * i;
@@ -164,11 +164,12 @@ lookup(uint32_t val, lookup_elem_t** e, size_t* pos) {
 int
 render(config_t* conf, uint32_t* map) {
 	int                 rv = 0;
-	size_t              i, j;
+	size_t              i, j, k;
 	color_t             col;
 	double              factor;
 	bmp_write_handle_t* bmph    = NULL;
-	size_t              mapsize = conf->width * conf->height;
+	size_t              mapsize = (size_t) conf_map_width(conf) * conf->height;
+	size_t              pixels  = (size_t) conf->width * conf->height;
 
 	lookup_elem_t** lookups = NULL;
 	size_t*         poss    = NULL;
@@ -198,13 +199,14 @@ render(config_t* conf, uint32_t* map) {
 		lens[i] = lookup_len(lookups[i]);
 	}
 
-	for(i = 0; i < mapsize; i++) {
+	for(i = 0; i < pixels; i++) {
 		col.r = 0;
 		col.g = 0;
 		col.b = 0;
 
+		k = conf_map_index(conf, i);
 		for(j = 0; j < conf->iters_n; j++) {
-			factor = (double) lookup(map[i + mapsize * j], &(lookups[j]), &(poss[j])) / (double) lens[j];
+			factor = (double) lookup(map[k + mapsize * j], &(lookups[j]), &(poss[j])) / (double) lens[j];
 			col    = color_add(col, color_mul(conf->colors[j], factor));
 		}
 		if(!bmp_write_pixel(bmph, color_fix(col))) {
@@ -0,0 +1,143 @@
+#ifndef _nebula2_rng_h_
+#define _nebula2_rng_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"): A keyed bijection
+ * of a 128 bit counter. The random numbers of sample i are philox(seed, i), so they don't depend
+ * on which thread calculates the sample or when.
+ */
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+
+/*
+ * Generate the 128 random bits of the n samples first ... first + n - 1 (as two 64 bit halves).
+ * The loop bodies are independent, so the compiler turns this into SIMD code that handles whole
+ * vectors of counters at once.
+ */
+inline static void
+philox_fill(uint64_t seed, uint64_t first, size_t n, uint64_t* lo, uint64_t* hi) {
+	size_t   i;
+	int      r;
+	uint32_t c0, c1, c2, c3, k0, k1;
+	uint64_t p0, p1;
+
+	for(i = 0; i < n; i++) {
+		c0 = (uint32_t) (first + i);
+		c1 = (uint32_t) ((first + i) >> 32);
+		c2 = 0;
+		c3 = 0;
+		k0 = (uint32_t) seed;
+		k1 = (uint32_t) (seed >> 32);
+
+		for(r = 0; r < 10; r++) {
+			p0 = (uint64_t) PHILOX_M0 * c0;
+			p1 = (uint64_t) PHILOX_M1 * c2;
+			c0 = ((uint32_t) (p1 >> 32)) ^ c1 ^ k0;
+			c1 = (uint32_t) p1;
+			c2 = ((uint32_t) (p0 >> 32)) ^ c3 ^ k1;
+			c3 = (uint32_t) p0;
+			k0 += PHILOX_W0;
+			k1 += PHILOX_W1;
+		}
+
+		lo[i] = ((uint64_t) c1 << 32) | c0;
+		hi[i] = ((uint64_t) c3 << 32) | c2;
+	}
+}
+
+/*
+ * Owen scrambled Sobol points (the first two dimensions), using the hash based scrambling by
+ * Burley ("Practical Hash-based Owen Scrambling", 2020). Every 2^32 samples (the resolution of the
+ * points) a new, independent scrambling is used.
+ */
+#define SOBOL_BITS 32
+
+/* Direction number k of dimension dim */
+inline static uint32_t
+sobol_dir(int dim, int k) {
+	uint32_t v = 1U << 31;
+
+	/* Dimension 0 is the van der Corput sequence, dimension 1 has the primitive polynomial x + 1. */
+	for(; (dim == 1) && (k > 0); k--) {
+		v ^= v >> 1;
+	}
+	return (dim == 0) ? v >> k : v;
+}
+
+inline static uint32_t
+reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+inline static uint32_t
+owen_scramble(uint32_t x, uint32_t seed) {
+	x  = reverse_bits(x);
+	x ^= x * 0x3d20adea;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56;
+	x ^= x * 0x53a22864;
+	return reverse_bits(x);
+}
+
+/* Seed of the scrambling of dimension dim for the samples epoch * 2^32 ... (splitmix64) */
+inline static uint32_t
+sobol_seed(uint64_t seed, uint64_t epoch, int dim) {
+	uint64_t z = seed + (epoch * 2 + dim + 1) * 0x9E3779B97F4A7C15ULL;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return (uint32_t) (z ^ (z >> 31));
+}
+
+/*
+ * Fill xy with the points of the samples first ... first + n - 1 (x in the upper, y in the lower 32
+ * bits). Sample i gets the point with index gray(i), so a block of points can be updated
+ * incrementally.
+ */
+inline static void
+sobol_fill(uint64_t seed, uint64_t first, size_t n, uint64_t* xy) {
+	size_t   i;
+	int      k;
+	uint64_t idx;
+	uint32_t gray, x, y, sx, sy;
+
+	for(i = 0; i < n; ) {
+		idx  = first + i;
+		sx   = sobol_seed(seed, idx >> SOBOL_BITS, 0);
+		sy   = sobol_seed(seed, idx >> SOBOL_BITS, 1);
+		gray = (uint32_t) idx ^ ((uint32_t) idx >> 1);
+
+		x = y = 0;
+		for(k = 0; k < SOBOL_BITS; k++) {
+			if(gray & (1U << k)) {
+				x ^= sobol_dir(0, k);
+				y ^= sobol_dir(1, k);
+			}
+		}
+
+		/* Within an epoch, the next point differs in the direction of the lowest zero bit of idx. */
+		for(;; ) {
+			xy[i] = ((uint64_t) owen_scramble(x, sx) << 32) | owen_scramble(y, sy);
+			i++;
+			if((i == n) || ((uint32_t) idx == UINT32_MAX)) {
+				break;
+			}
+			k  = __builtin_ctz((uint32_t) ~idx);
+			x ^= sobol_dir(0, k);
+			y ^= sobol_dir(1, k);
+			idx++;
+		}
+	}
+}
+
+#endif
@@ -1,72 +1,1276 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "config.h"
+#include "statefile.h"
 
-int
-state_load(config_t* conf, uint32_t* map, uint32_t* jobs_done) {
-	FILE*  fh = NULL;
-	size_t mapsize;
-	int    errsv;
+#define STATE_TMP_SUFFIX  ".tmp"
+#define STATE_DIRTY       0xffffffff
+#define STATE_ALIGN       4096 /* The map starts at a multiple of it */
+#define STATE_MAX_THREADS 64
+#define STATE_BATCH       4 /* Chunks per thread that are encoded before they are written */
+
+/* Bytes of a chunk and an upper bound of its encoding (5 bytes per varint token) */
+#define CHUNK_BYTES   (sizeof(uint32_t) * STATE_CHUNK)
+#define CHUNK_ENCODED (5 * STATE_CHUNK)
+
+/* Constants of the chunk checksum (the primes of xxHash64) */
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+#define PRIME4 0x85ebca77c2b2ae63ULL
+
+/* The map of a statefile, that is processed chunk by chunk by several threads */
+typedef struct {
+	config_t* conf;
+	uint32_t* map;
+	size_t    cells;
+	uint64_t* sums;
+	uint8_t*  dirty;    /* Only the flagged chunks are checksummed (if not NULL) */
+	int       fd;       /* The chunks are read from it (if >= 0) */
+	off_t     base;     /* Offset of the first chunk in fd */
+	uint64_t* offsets;  /* Of the encoded chunks, relative to base (NULL, if they are raw) */
+	uint8_t** encoded;  /* The encoded chunks to write */
+	size_t*   lens;
+	uint8_t*  bufs[STATE_MAX_THREADS]; /* For the encoded chunks, one per thread */
+} chunk_io_t;
+
+typedef struct chunk_range chunk_range_t;
+
+/* Process chunk c, returns 0 on errors (with errno set) */
+typedef int (*chunk_fn_t)(chunk_io_t* io, chunk_range_t* range, uint32_t c);
+
+/* A range of chunks, that is processed by one thread */
+struct chunk_range {
+	chunk_io_t* io;
+	chunk_fn_t  fn;
+	uint32_t    first, last;
+	uint8_t*    buf; /* For the encoded chunks */
+	size_t      used;
+	int         ok;
+	int         errsv;
+	pthread_t   thread;
+	int         thread_started;
+};
+
+static size_t
+map_cells(config_t* conf) {
+	return (size_t) conf_map_width(conf) * conf->height * conf->iters_n;
+}
+
+static uint32_t
+chunks_n(config_t* conf) {
+	return (map_cells(conf) + STATE_CHUNK - 1) / STATE_CHUNK;
+}
+
+/* Size of the fixed part of the header (version 2 had no encoding, version 3 no MH and mask settings) */
+static size_t
+fixed_size(uint32_t version) {
+	switch(version) {
+	case 2:
+		return offsetof(state_header_t, encoding);
+	case 3:
+		return offsetof(state_header_t, mhlayer);
+	default:
+		return sizeof(state_header_t);
+	}
+}
+
+static uint32_t
+header_encoding(state_header_t* hdr) {
+	return (hdr->version == 2) ? STATE_RAW : hdr->encoding;
+}
+
+static size_t
+header_size(config_t* conf, uint32_t version, uint32_t encoding) {
+	size_t size = fixed_size(version) + sizeof(uint64_t) * chunks_n(conf) + sizeof(uint32_t) * conf->iters_n;
+
+	if(encoding != STATE_RAW) {
+		size += sizeof(uint64_t) * (chunks_n(conf) + 1);
+	}
+	return (size + STATE_ALIGN - 1) / STATE_ALIGN * STATE_ALIGN;
+}
+
+static uint64_t*
+header_sums(state_header_t* hdr) {
+	return (uint64_t*) ((char*) hdr + fixed_size(hdr->version));
+}
+
+/* The offsets of the encoded chunks, the last one is the end of the last chunk */
+static uint64_t*
+header_offsets(state_header_t* hdr) {
+	return header_sums(hdr) + hdr->chunks_n;
+}
+
+static uint32_t*
+header_iters(state_header_t* hdr) {
+	return (uint32_t*) (header_sums(hdr) + hdr->chunks_n + ((header_encoding(hdr) != STATE_RAW) ? hdr->chunks_n + 1 : 0));
+}
+
+/* The header of a mapped map */
+static state_header_t*
+mapped_header(config_t* conf, uint32_t* map) {
+	return (state_header_t*) ((char*) map - header_size(conf, STATE_VERSION, STATE_RAW));
+}
+
+/* The jobs_done of the header for samples (only informative, the samples count) */
+static uint32_t
+header_jobs(config_t* conf, uint64_t samples) {
+	uint64_t jobs = (conf->jobsize > 0) ? samples / conf->jobsize : 0;
+
+	return (jobs < STATE_DIRTY) ? jobs : STATE_DIRTY - 1;
+}
+
+/* Describe the map of conf (everything but the run, the checksums and the offsets). */
+static void
+init_header(config_t* conf, state_header_t* hdr, uint32_t jobs_done, uint32_t encoding) {
+	int i;
+
+	memset(hdr, 0, header_size(conf, STATE_VERSION, encoding));
+	memcpy(hdr->magic, STATE_MAGIC, sizeof(hdr->magic));
+	hdr->version     = STATE_VERSION;
+	hdr->jobs_done   = jobs_done;
+	hdr->header_size = header_size(conf, STATE_VERSION, encoding);
+	hdr->width       = conf_map_width(conf);
+	hdr->height      = conf->height;
+	hdr->iters_n     = conf->iters_n;
+	hdr->symmetry    = conf->symmetry;
+	hdr->chunks_n    = chunks_n(conf);
+	hdr->encoding    = encoding;
+	for(i = 0; i < conf->iters_n; i++) {
+		header_iters(hdr)[i] = conf->iters[i];
+	}
+}
+
+/* The settings of the run that wrote the map last */
+static void
+describe_run(config_t* conf, state_header_t* hdr, uint64_t samples) {
+	hdr->samples = samples;
+	hdr->jobsize = conf->jobsize;
+	hdr->sampler = conf->sampler;
+	hdr->mask    = conf->mask;
+	hdr->rng     = conf->rng;
+	hdr->seed    = conf->seed;
+
+	hdr->mhlayer    = conf->mhlayer;
+	hdr->mhboost    = conf->mhboost;
+	hdr->maskres    = conf->maskres;
+	hdr->maskweight = conf->maskweight;
+}
+
+/* Were the settings of the sampler and the mask the same? Unknown ones (0) match anything. */
+static int
+same_settings(config_t* conf, state_header_t* hdr) {
+	if((hdr->version < 4) || (hdr->mhboost == 0) || (conf->mhboost == 0)) {
+		return 1;
+	}
+	if((conf->sampler == SAMPLER_MH) && ((hdr->mhlayer != (uint32_t) conf->mhlayer) || (hdr->mhboost != (uint32_t) conf->mhboost))) {
+		return 0;
+	}
+	if(conf->mask && ((hdr->maskres != (uint32_t) conf->maskres) || (hdr->maskweight != (uint32_t) conf->maskweight))) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Does the fixed part of the header match the map of conf and the size of the file? */
+static int
+check_geometry(config_t* conf, state_header_t* hdr, off_t filesize) {
+	size_t size;
+
+	if((filesize < (off_t) fixed_size(2)) || (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) != 0)) {
+		fprintf(stderr, "%s is not a statefile.\n", conf->statefile);
+		goto failed;
+	}
+	if((hdr->version < 2) || (hdr->version > STATE_VERSION)) {
+		fprintf(stderr, "Statefile %s has the unknown version %" PRIu32 ".\n", conf->statefile, hdr->version);
+		goto failed;
+	}
+	if(
+	        (hdr->width != (uint32_t) conf_map_width(conf)) || (hdr->height != (uint32_t) conf->height) ||
+	        (hdr->iters_n != (uint32_t) conf->iters_n) || (hdr->symmetry != (uint32_t) conf->symmetry)) {
+		fprintf(stderr, "Statefile %s was made with another size, number of layers or symmetry.\n", conf->statefile);
+		goto failed;
+	}
+
+	/* The size of an encoded statefile is checked with the offsets. */
+	size = header_size(conf, hdr->version, header_encoding(hdr));
+	if(
+	        (header_encoding(hdr) > STATE_VARINT) || (hdr->chunks_n != chunks_n(conf)) || (hdr->header_size != size) ||
+	        ((header_encoding(hdr) == STATE_RAW) ? ((size_t) filesize != size + sizeof(uint32_t) * map_cells(conf)) : ((size_t) filesize < size))) {
+		fprintf(stderr, "Statefile %s is truncated or damaged.\n", conf->statefile);
+		goto failed;
+	}
+	return 1;
+
+failed:
+	errno = EINVAL;
+	return 0;
+}
+
+/* Do the offsets of the encoded chunks fit the chunks and the size of the file? */
+static int
+check_offsets(config_t* conf, state_header_t* hdr, off_t filesize) {
+	uint32_t  c;
+	uint64_t* offsets = header_offsets(hdr);
+
+	for(c = 0; c < hdr->chunks_n; c++) {
+		if((offsets[c + 1] < offsets[c]) || (offsets[c + 1] - offsets[c] > CHUNK_BYTES)) {
+			break;
+		}
+	}
+	if((offsets[0] != 0) || (c < hdr->chunks_n) || ((uint64_t) filesize != hdr->header_size + offsets[hdr->chunks_n])) {
+		fprintf(stderr, "Statefile %s is truncated or damaged.\n", conf->statefile);
+		errno = EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+/* Can the run of conf continue the statefile with the (complete) header? Sets samples. */
+static int
+check_run(config_t* conf, state_header_t* hdr, uint64_t* samples) {
+	int i;
+
+	for(i = 0; i < conf->iters_n; i++) {
+		if(header_iters(hdr)[i] != (uint32_t) conf->iters[i]) {
+			fprintf(stderr, "Statefile %s was made with other iterations (iter%d=%" PRIu32 ").\n", conf->statefile, i, header_iters(hdr)[i]);
+			goto failed;
+		}
+	}
+	/* The sampler and the mask (and their settings) change the absolute counts. */
+	if((hdr->sampler != (uint32_t) conf->sampler) || (hdr->mask != (uint32_t) conf->mask)) {
+		fprintf(stderr, "Statefile %s was made with another sampler or mask.\n", conf->statefile);
+		goto failed;
+	}
+	if(!same_settings(conf, hdr)) {
+		fprintf(stderr, "Statefile %s was made with other settings of the sampler or mask (mhlayer=%" PRIu32 ", mhboost=%" PRIu32 ", maskres=%" PRIu32 ", maskweight=%" PRIu32 ").\n",
+		        conf->statefile, hdr->mhlayer, hdr->mhboost, hdr->maskres, hdr->maskweight);
+		goto failed;
+	}
+	if(hdr->jobs_done == STATE_DIRTY) {
+		fprintf(stderr, "Statefile %s was not closed cleanly.\n", conf->statefile);
+		goto failed;
+	}
+
+	/* The samples are counted exactly, so jobsize can change (and indexed samples continue right). */
+	*samples = hdr->samples;
+	return 1;
+
+failed:
+	errno = EINVAL;
+	return 0;
+}
+
+static inline uint64_t
+rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+/* A 64 bit checksum of n cells (in 4 interleaved lanes, like xxHash64, so it keeps up with memory) */
+static uint64_t
+chunk_checksum(const uint32_t* cells, size_t n) {
+	uint64_t h[4] = { PRIME1, PRIME2, PRIME3, PRIME4 };
+	uint64_t sum  = n;
+	size_t   i;
+	int      l;
+
+	for(i = 0; i + 4 <= n; i += 4) {
+		for(l = 0; l < 4; l++) {
+			h[l] = rotl(h[l] + cells[i + l] * PRIME2, 31) * PRIME1;
+		}
+	}
+	for(; i < n; i++) {
+		h[0] = rotl(h[0] + cells[i] * PRIME2, 31) * PRIME1;
+	}
+
+	for(l = 0; l < 4; l++) {
+		sum = rotl(sum ^ h[l], 27) * PRIME1 + PRIME4;
+	}
+	sum ^= sum >> 33;
+	sum *= PRIME2;
+	sum ^= sum >> 29;
+	return sum;
+}
+
+/*
+ * Encode n cells as varint tokens: An even token is the difference to the previous cell (zigzag
+ * encoded), an odd one a run of (token >> 1) + 1 cells equal to the previous one. Neighbouring
+ * cells are similar and the deep layers are mostly zeros, so most cells take a byte or less.
+ */
+static size_t
+encode_cells(const uint32_t* cells, size_t n, uint8_t* out) {
+	size_t   i, run;
+	int64_t  d;
+	uint64_t token;
+	uint32_t prev = 0;
+	uint8_t* p    = out;
+
+	for(i = 0; i < n; ) {
+		for(run = 0; (i + run < n) && (cells[i + run] == prev); run++) {
+		}
+
+		if(run > 0) {
+			token  = ((uint64_t) (run - 1) << 1) | 1;
+			i     += run;
+		} else {
+			d     = (int64_t) cells[i] - prev;
+			token = (((uint64_t) d << 1) ^ (uint64_t) (d >> 63)) << 1;
+			prev  = cells[i++];
+		}
+
+		for(; token >= 0x80; token >>= 7) {
+			*(p++) = (token & 0x7f) | 0x80;
+		}
+		*(p++) = token;
+	}
+	return p - out;
+}
+
+/* Decode len bytes into exactly n cells, returns 0 if they are invalid. */
+static int
+decode_cells(const uint8_t* in, size_t len, uint32_t* cells, size_t n) {
+	size_t         i = 0, run;
+	int            shift;
+	uint64_t       token, zz;
+	uint32_t       prev = 0;
+	const uint8_t* end  = in + len;
+
+	while(in < end) {
+		token = 0;
+		for(shift = 0; ; shift += 7) {
+			if((in >= end) || (shift > 63)) {
+				return 0;
+			}
+			token |= (uint64_t) (*in & 0x7f) << shift;
+			if(!(*(in++) & 0x80)) {
+				break;
+			}
+		}
+
+		if(token & 1) {
+			run = (token >> 1) + 1;
+			if(run > n - i) {
+				return 0;
+			}
+			for(; run > 0; run--) {
+				cells[i++] = prev;
+			}
+		} else {
+			if(i >= n) {
+				return 0;
+			}
+			zz         = token >> 1;
+			prev      += (uint32_t) ((zz >> 1) ^ -(zz & 1));
+			cells[i++] = prev;
+		}
+	}
+	return i == n;
+}
+
+/* pread, until all n bytes are read */
+static int
+read_all(int fd, void* buf, size_t n, off_t offset) {
+	ssize_t r;
+
+	while(n > 0) {
+		if((r = pread(fd, buf, n, offset)) <= 0) {
+			if(r == 0) {
+				errno = EIO;
+			}
+			return 0;
+		}
+		buf     = (char*) buf + r;
+		n      -= r;
+		offset += r;
+	}
+	return 1;
+}
+
+/* First and number of cells of chunk c */
+static size_t
+chunk_cells(chunk_io_t* io, uint32_t c, size_t* start) {
+	*start = (size_t) c * STATE_CHUNK;
+	return (io->cells - *start < STATE_CHUNK) ? io->cells - *start : STATE_CHUNK;
+}
+
+static int
+checksum_chunk(chunk_io_t* io, chunk_range_t* range, uint32_t c) {
+	size_t start, n = chunk_cells(io, c, &start);
+
+	if(io->dirty) {
+		if(!io->dirty[c]) {
+			return 1;
+		}
+		io->dirty[c] = 0;
+	}
+	io->sums[c] = chunk_checksum(io->map + start, n);
+	return 1;
+}
+
+/*
+ * Read the n cells of chunk c from fd (offsets as in chunk_io_t), buf is for the encoded chunk.
+ * Chunks that don't get smaller are stored raw.
+ */
+static int
+load_chunk(config_t* conf, int fd, off_t base, uint64_t* offsets, uint32_t c, uint32_t* cells, size_t n, uint8_t* buf) {
+	size_t len;
 
-	mapsize = conf->width * conf->height * conf->iters_n;
+	if(!offsets || (offsets[c + 1] - offsets[c] == sizeof(uint32_t) * n)) {
+		return read_all(fd, cells, sizeof(uint32_t) * n, base + (offsets ? offsets[c] : (off_t) c * CHUNK_BYTES));
+	}
+
+	len = offsets[c + 1] - offsets[c];
+	if(!read_all(fd, buf, len, base + offsets[c])) {
+		return 0;
+	}
+	if(!decode_cells(buf, len, cells, n)) {
+		fprintf(stderr, "Statefile %s is damaged (chunk %" PRIu32 " can't be decoded).\n", conf->statefile, c);
+		errno = EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+static int
+read_chunk(chunk_io_t* io, chunk_range_t* range, uint32_t c) {
+	size_t start;
+	size_t n = chunk_cells(io, c, &start);
+
+	if(!load_chunk(io->conf, io->fd, io->base, io->offsets, c, io->map + start, n, range->buf)) {
+		return 0;
+	}
+	return checksum_chunk(io, range, c);
+}
+
+static int
+encode_chunk(chunk_io_t* io, chunk_range_t* range, uint32_t c) {
+	size_t start, len;
+	size_t n = chunk_cells(io, c, &start);
+
+	len = encode_cells(io->map + start, n, range->buf + range->used);
+	if(len < sizeof(uint32_t) * n) {
+		io->encoded[c]  = range->buf + range->used;
+		io->lens[c]     = len;
+		range->used    += len;
+	} else {
+		io->encoded[c] = (uint8_t*) (io->map + start);
+		io->lens[c]    = sizeof(uint32_t) * n;
+	}
+	return checksum_chunk(io, range, c);
+}
+
+static void*
+process_chunks(void* _range) {
+	uint32_t c;
+
+	/* Aliases */
+	chunk_range_t* range = _range;
+
+	range->ok = 0;
+	for(c = range->first; c < range->last; c++) {
+		if(!range->fn(range->io, range, c)) {
+			range->errsv = errno;
+			return NULL;
+		}
+	}
+	range->ok = 1;
+	return NULL;
+}
 
-	if(!(fh = fopen(conf->statefile, "rb"))) {
+/* Number of threads for n chunks */
+static int
+chunk_threads(config_t* conf, uint32_t n) {
+	long threads = (conf->threads > 0) ? conf->threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+	threads = (threads > STATE_MAX_THREADS) ? STATE_MAX_THREADS : threads;
+	threads = (threads > n) ? n : threads;
+	return (threads < 1) ? 1 : threads;
+}
+
+/* The buffers of threads threads of size bytes each (for reading or encoding chunks) */
+static int
+alloc_bufs(chunk_io_t* io, int threads, size_t size) {
+	int i;
+
+	for(i = 0; i < threads; i++) {
+		if(!(io->bufs[i] = malloc(size))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+free_bufs(chunk_io_t* io) {
+	int i;
+
+	for(i = 0; i < STATE_MAX_THREADS; i++) {
+		free(io->bufs[i]);
+		io->bufs[i] = NULL;
+	}
+}
+
+/*
+ * Process the chunks first to last - 1 with fn. They are split between threads (or processed
+ * here, if a thread can't be started), thread i uses io->bufs[i].
+ */
+static int
+run_chunks(chunk_io_t* io, chunk_fn_t fn, uint32_t first, uint32_t last) {
+	chunk_range_t ranges[STATE_MAX_THREADS];
+	int           i;
+	int           rv      = 1;
+	int           threads = chunk_threads(io->conf, last - first);
+
+	for(i = 0; i < threads; i++) {
+		ranges[i].io    = io;
+		ranges[i].fn    = fn;
+		ranges[i].first = first + (uint64_t) (last - first) * i / threads;
+		ranges[i].last  = first + (uint64_t) (last - first) * (i + 1) / threads;
+		ranges[i].buf   = io->bufs[i];
+		ranges[i].used  = 0;
+
+		ranges[i].thread_started = (pthread_create(&(ranges[i].thread), NULL, process_chunks, ranges + i) == 0);
+		if(!ranges[i].thread_started) {
+			process_chunks(ranges + i);
+		}
+	}
+
+	for(i = 0; i < threads; i++) {
+		if(ranges[i].thread_started) {
+			pthread_join(ranges[i].thread, NULL);
+		}
+		if(!ranges[i].ok && rv) {
+			errno = ranges[i].errsv;
+			rv    = 0;
+		}
+	}
+	return rv;
+}
+
+/* Set up io for the map of conf (without buffers). */
+static void
+init_io(chunk_io_t* io, config_t* conf, uint32_t* map, uint64_t* sums) {
+	memset(io, 0, sizeof(chunk_io_t));
+	io->conf  = conf;
+	io->map   = map;
+	io->cells = map_cells(conf);
+	io->sums  = sums;
+	io->fd    = -1;
+}
+
+/* Compare the checksums of the map with the ones in the header. */
+static int
+verify_chunks(config_t* conf, state_header_t* hdr, uint64_t* sums) {
+	uint32_t c;
+
+	for(c = 0; c < hdr->chunks_n; c++) {
+		if(sums[c] != header_sums(hdr)[c]) {
+			fprintf(stderr, "Statefile %s is damaged (chunk %" PRIu32 " of %" PRIu32 ").\n", conf->statefile, c, hdr->chunks_n);
+			errno = EINVAL;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* A statefile of the first format: jobs_done, followed by the map */
+static int
+load_unversioned(config_t* conf, int fd, uint32_t* map, uint64_t* samples) {
+	uint32_t jobs_done;
+
+	if(!read_all(fd, &jobs_done, sizeof(uint32_t), 0)) {
+		return 0;
+	}
+	if(jobs_done == STATE_DIRTY) {
+		fprintf(stderr, "Statefile %s was not closed cleanly.\n", conf->statefile);
+		errno = EINVAL;
+		return 0;
+	}
+	*samples = (uint64_t) jobs_done * conf->jobsize;
+	return read_all(fd, map, sizeof(uint32_t) * map_cells(conf), sizeof(uint32_t));
+}
+
+int
+state_load(config_t* conf, uint32_t* map, uint64_t* samples) {
+	int             fd;
+	int             errsv;
+	struct stat     st;
+	chunk_io_t      io;
+	state_header_t  fixed;
+	state_header_t* hdr  = NULL;
+	uint64_t*       sums = NULL;
+	int             rv   = 0;
+
+	if((fd = open(conf->statefile, O_RDONLY)) < 0) {
 		if(errno == ENOENT) {
-			memset(map, 0, mapsize);
-			*jobs_done = 0;
+			memset(map, 0, sizeof(uint32_t) * map_cells(conf));
+			*samples = 0;
 			return 1;
 		}
 
 		return 0;
 	}
+	init_io(&io, conf, map, NULL);
+	if(fstat(fd, &st) != 0) {
+		goto tidyup;
+	}
 
-	if(fread(jobs_done, sizeof(uint32_t), 1, fh) != 1) {
+	if((size_t) st.st_size == sizeof(uint32_t) * (1 + map_cells(conf))) {
+		rv = load_unversioned(conf, fd, map, samples);
+		goto tidyup;
+	}
+
+	memset(&fixed, 0, sizeof(state_header_t));
+	if(!read_all(fd, &fixed, (st.st_size < (off_t) sizeof(state_header_t)) ? st.st_size : sizeof(state_header_t), 0)) {
+		goto tidyup;
+	}
+	if(!check_geometry(conf, &fixed, st.st_size)) {
+		goto tidyup;
+	}
+	if(
+	        !(hdr = malloc(fixed.header_size)) ||
+	        !(sums = malloc(sizeof(uint64_t) * fixed.chunks_n))) {
+		goto tidyup;
+	}
+	if(!read_all(fd, hdr, fixed.header_size, 0) || !check_run(conf, hdr, samples)) {
+		goto tidyup;
+	}
+
+	io.sums = sums;
+	io.fd   = fd;
+	io.base = hdr->header_size;
+	if(header_encoding(hdr) != STATE_RAW) {
+		if(!check_offsets(conf, hdr, st.st_size) || !alloc_bufs(&io, chunk_threads(conf, hdr->chunks_n), CHUNK_BYTES)) {
+			goto tidyup;
+		}
+		io.offsets = header_offsets(hdr);
+	}
+
+	if(!run_chunks(&io, read_chunk, 0, hdr->chunks_n) || !verify_chunks(conf, hdr, sums)) {
+		goto tidyup;
+	}
+	rv = 1;
+
+tidyup:
+	errsv = errno;
+	free_bufs(&io);
+	free(hdr);
+	free(sums);
+	close(fd);
+	errno = errsv;
+	return rv;
+}
+
+/* Write fh to disk and close it (also on errors). */
+static int
+close_synced(FILE* fh) {
+	int errsv;
+
+	if((fflush(fh) != 0) || (fsync(fileno(fh)) != 0)) {
 		errsv = errno;
 		fclose(fh);
 		errno = errsv;
 		return 0;
 	}
+	return fclose(fh) == 0;
+}
 
-	if(fread(map, sizeof(uint32_t), mapsize, fh) != mapsize) {
-		errsv = errno;
+/* Write the directory of path to disk, so a rename to path survives a crash. */
+static int
+sync_dir(const char* path) {
+	int   fd, rv;
+	char* dir;
+	char* slash;
+
+	if(!(dir = malloc(strlen(path) + 2))) {
+		return 0;
+	}
+	strcpy(dir, path);
+	if(!(slash = strrchr(dir, '/'))) {
+		strcpy(dir, ".");
+	} else {
+		slash[(slash == dir) ? 1 : 0] = '\0';
+	}
+
+	if((fd = open(dir, O_RDONLY)) < 0) {
+		free(dir);
+		return 0;
+	}
+	rv = (fsync(fd) == 0);
+	close(fd);
+	free(dir);
+	return rv;
+}
+
+/*
+ * Encode the chunks in batches (so the encoded map never needs to fit into memory) and write
+ * them to fh in order, after the header. Sets the offsets of the header.
+ */
+static int
+write_encoded(chunk_io_t* io, state_header_t* hdr, FILE* fh) {
+	uint32_t  c, batch, end;
+	int       rv      = 0;
+	int       threads = chunk_threads(io->conf, hdr->chunks_n);
+	uint64_t* offsets = header_offsets(hdr);
+
+	if(
+	        !(io->encoded = malloc(sizeof(uint8_t*) * hdr->chunks_n)) ||
+	        !(io->lens = malloc(sizeof(size_t) * hdr->chunks_n)) ||
+	        !alloc_bufs(io, threads, STATE_BATCH * CHUNK_ENCODED)) {
+		goto tidyup;
+	}
+
+	offsets[0] = 0;
+	for(batch = 0; batch < hdr->chunks_n; batch = end) {
+		end = (hdr->chunks_n - batch < (uint32_t) threads * STATE_BATCH) ? hdr->chunks_n : batch + threads * STATE_BATCH;
+		if(!run_chunks(io, encode_chunk, batch, end)) {
+			goto tidyup;
+		}
+		for(c = batch; c < end; c++) {
+			if(fwrite(io->encoded[c], 1, io->lens[c], fh) != io->lens[c]) {
+				goto tidyup;
+			}
+			offsets[c + 1] = offsets[c] + io->lens[c];
+		}
+	}
+	rv = 1;
+
+tidyup:
+	free_bufs(io);
+	free(io->encoded);
+	free(io->lens);
+	return rv;
+}
+
+/*
+ * The state is written to a temporary file that replaces the statefile, so an interrupted save
+ * keeps the previous state. The file and the rename are synced, so a crash can't leave a
+ * truncated statefile either. With compress=1, the header is written again after the chunks.
+ */
+int
+state_save(config_t* conf, uint32_t* map, uint64_t samples) {
+	FILE*           fh      = NULL;
+	char*           tmppath = NULL;
+	state_header_t* hdr     = NULL;
+	chunk_io_t      io;
+	int             errsv;
+	uint32_t        encoding = conf->compress ? STATE_VARINT : STATE_RAW;
+
+	if(!(tmppath = malloc(strlen(conf->statefile) + strlen(STATE_TMP_SUFFIX) + 1))) {
+		return 0;
+	}
+	strcat(strcpy(tmppath, conf->statefile), STATE_TMP_SUFFIX);
+
+	if(!(hdr = malloc(header_size(conf, STATE_VERSION, encoding)))) {
+		goto failed;
+	}
+	init_header(conf, hdr, header_jobs(conf, samples), encoding);
+	describe_run(conf, hdr, samples);
+	init_io(&io, conf, map, header_sums(hdr));
+
+	if(!(fh = fopen(tmppath, "wb"))) {
+		goto failed;
+	}
+
+	if(encoding == STATE_RAW) {
+		if(!run_chunks(&io, checksum_chunk, 0, hdr->chunks_n)) {
+			goto failed;
+		}
+		if(fwrite(hdr, hdr->header_size, 1, fh) != 1) {
+			goto failed;
+		}
+		if(fwrite(map, sizeof(uint32_t), map_cells(conf), fh) != map_cells(conf)) {
+			goto failed;
+		}
+	} else {
+		if(fseek(fh, hdr->header_size, SEEK_SET) != 0) {
+			goto failed;
+		}
+		if(!write_encoded(&io, hdr, fh)) {
+			goto failed;
+		}
+		if((fseek(fh, 0, SEEK_SET) != 0) || (fwrite(hdr, hdr->header_size, 1, fh) != 1)) {
+			goto failed;
+		}
+	}
+
+	if(!close_synced(fh)) {
+		fh = NULL;
+		goto failed;
+	}
+	fh = NULL;
+
+	if((rename(tmppath, conf->statefile) != 0) || !sync_dir(conf->statefile)) {
+		goto failed;
+	}
+
+	free(hdr);
+	free(tmppath);
+	return 1;
+
+failed:
+	errsv = errno;
+	if(fh) {
 		fclose(fh);
-		errno = errsv;
+	}
+	remove(tmppath);
+	free(hdr);
+	free(tmppath);
+	errno = errsv;
+	return 0;
+}
+
+int
+state_config(char* path, config_t** conf) {
+	int             fd;
+	int             errsv;
+	int             i;
+	struct stat     st;
+	state_header_t  fixed;
+	state_header_t* hdr = NULL;
+
+	*conf = NULL;
+	if((fd = open(path, O_RDONLY)) < 0) {
 		return 0;
 	}
+	if(fstat(fd, &st) != 0) {
+		goto failed;
+	}
+	memset(&fixed, 0, sizeof(state_header_t));
+	if(!read_all(fd, &fixed, (st.st_size < (off_t) sizeof(state_header_t)) ? st.st_size : sizeof(state_header_t), 0)) {
+		goto failed;
+	}
+	if((st.st_size < (off_t) fixed_size(2)) || (memcmp(fixed.magic, STATE_MAGIC, sizeof(fixed.magic)) != 0)) {
+		fprintf(stderr, "%s is not a statefile or has the first format (which doesn't record its settings).\n", path);
+		errno = EINVAL;
+		goto failed;
+	}
+
+	if(!(*conf = calloc(1, sizeof(config_t)))) {
+		goto failed;
+	}
+	(*conf)->statefile = path;
+	(*conf)->width     = (fixed.symmetry == SYMMETRY_FOLD) ? 2 * fixed.width : fixed.width;
+	(*conf)->height    = fixed.height;
+	(*conf)->iters_n   = fixed.iters_n;
+	(*conf)->symmetry  = fixed.symmetry;
+	if(!check_geometry(*conf, &fixed, st.st_size)) {
+		goto failed;
+	}
+
+	if(
+	        !(hdr = malloc(fixed.header_size)) ||
+	        !((*conf)->iters = malloc(sizeof(int) * fixed.iters_n))) {
+		goto failed;
+	}
+	if(!read_all(fd, hdr, fixed.header_size, 0)) {
+		goto failed;
+	}
+	for(i = 0; i < (*conf)->iters_n; i++) {
+		(*conf)->iters[i] = header_iters(hdr)[i];
+	}
+	(*conf)->jobsize  = hdr->jobsize;
+	(*conf)->sampler  = hdr->sampler;
+	(*conf)->mask     = hdr->mask;
+	(*conf)->rng      = hdr->rng;
+	(*conf)->seed     = hdr->seed;
+	(*conf)->compress = (header_encoding(hdr) != STATE_RAW);
+	if(hdr->version >= 4) {
+		(*conf)->mhlayer    = hdr->mhlayer;
+		(*conf)->mhboost    = hdr->mhboost;
+		(*conf)->maskres    = hdr->maskres;
+		(*conf)->maskweight = hdr->maskweight;
+	}
 
-	fclose(fh);
+	free(hdr);
+	close(fd);
 	return 1;
+
+failed:
+	errsv = errno;
+	if(*conf) {
+		conf_destroy(*conf);
+		*conf = NULL;
+	}
+	free(hdr);
+	close(fd);
+	errno = errsv;
+	return 0;
 }
 
+state_reader_t*
+state_open(config_t* conf, char* path) {
+	int             errsv;
+	uint64_t        samples;
+	struct stat     st;
+	state_header_t  fixed;
+	state_reader_t* reader;
+
+	if(!(reader = malloc(sizeof(state_reader_t)))) {
+		return NULL;
+	}
+	reader->hdr = NULL;
+	reader->buf = NULL;
+
+	reader->conf           = *conf;
+	reader->conf.statefile = path;
+
+	if((reader->fd = open(path, O_RDONLY)) < 0) {
+		free(reader);
+		return NULL;
+	}
+	if(fstat(reader->fd, &st) != 0) {
+		goto failed;
+	}
+	reader->dev = st.st_dev;
+	reader->ino = st.st_ino;
+
+	memset(&fixed, 0, sizeof(state_header_t));
+	if(!read_all(reader->fd, &fixed, (st.st_size < (off_t) sizeof(state_header_t)) ? st.st_size : sizeof(state_header_t), 0)) {
+		goto failed;
+	}
+	if(!check_geometry(&(reader->conf), &fixed, st.st_size)) {
+		goto failed;
+	}
+	if(!(reader->hdr = malloc(fixed.header_size))) {
+		goto failed;
+	}
+	if(!read_all(reader->fd, reader->hdr, fixed.header_size, 0) || !check_run(&(reader->conf), reader->hdr, &samples)) {
+		goto failed;
+	}
+	if(header_encoding(reader->hdr) != STATE_RAW) {
+		if(!check_offsets(&(reader->conf), reader->hdr, st.st_size) || !(reader->buf = malloc(CHUNK_BYTES))) {
+			goto failed;
+		}
+	}
+	return reader;
+
+failed:
+	errsv = errno;
+	state_close(reader);
+	errno = errsv;
+	return NULL;
+}
+
+/* Copies have the same samples and checksums (in any encoding), empty maps are all the same. */
 int
-state_save(config_t* conf, uint32_t* map, uint32_t jobs_done) {
-	FILE*  fh = NULL;
-	size_t mapsize;
-	int    errsv;
+state_same(state_reader_t* a, state_reader_t* b) {
+	uint32_t c;
 
-	mapsize = conf->width * conf->height * conf->iters_n;
+	if((a->dev == b->dev) && (a->ino == b->ino)) {
+		return 1;
+	}
+	if((a->hdr->samples != b->hdr->samples) || (a->hdr->samples == 0)) {
+		return 0;
+	}
+	for(c = 0; c < a->hdr->chunks_n; c++) {
+		if(header_sums(a->hdr)[c] != header_sums(b->hdr)[c]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+size_t
+state_read(state_reader_t* reader, uint32_t c, uint32_t* cells) {
+	size_t start = (size_t) c * STATE_CHUNK;
+	size_t n     = (map_cells(&(reader->conf)) - start < STATE_CHUNK) ? map_cells(&(reader->conf)) - start : STATE_CHUNK;
 
-	if(!(fh = fopen(conf->statefile, "wb"))) {
+	/* Aliases */
+	state_header_t* hdr = reader->hdr;
+
+	if(!load_chunk(&(reader->conf), reader->fd, hdr->header_size, (header_encoding(hdr) != STATE_RAW) ? header_offsets(hdr) : NULL, c, cells, n, reader->buf)) {
+		return 0;
+	}
+	if(chunk_checksum(cells, n) != header_sums(hdr)[c]) {
+		fprintf(stderr, "Statefile %s is damaged (chunk %" PRIu32 " of %" PRIu32 ").\n", reader->conf.statefile, c, hdr->chunks_n);
+		errno = EINVAL;
 		return 0;
 	}
+	return n;
+}
 
-	if(fwrite(&jobs_done, sizeof(uint32_t), 1, fh) != 1) {
-		errsv = errno;
-		fclose(fh);
-		errno = errsv;
+void
+state_close(state_reader_t* reader) {
+	close(reader->fd);
+	free(reader->hdr);
+	free(reader->buf);
+	free(reader);
+}
+
+state_writer_t*
+state_create(config_t* conf) {
+	state_writer_t* writer;
+	int             errsv;
+	uint32_t        encoding = conf->compress ? STATE_VARINT : STATE_RAW;
+
+	if(!(writer = malloc(sizeof(state_writer_t)))) {
+		return NULL;
+	}
+	writer->conf    = conf;
+	writer->tmppath = NULL;
+	writer->fh      = NULL;
+	writer->hdr     = NULL;
+	writer->buf     = NULL;
+	writer->next    = 0;
+
+	if(
+	        !(writer->tmppath = malloc(strlen(conf->statefile) + strlen(STATE_TMP_SUFFIX) + 1)) ||
+	        !(writer->hdr = malloc(header_size(conf, STATE_VERSION, encoding)))) {
+		goto failed;
+	}
+	strcat(strcpy(writer->tmppath, conf->statefile), STATE_TMP_SUFFIX);
+	init_header(conf, writer->hdr, 0, encoding);
+
+	if(encoding != STATE_RAW) {
+		if(!(writer->buf = malloc(CHUNK_ENCODED))) {
+			goto failed;
+		}
+		header_offsets(writer->hdr)[0] = 0;
+	}
+
+	/* The header is written by state_commit, when the checksums and offsets are known. */
+	if(!(writer->fh = fopen(writer->tmppath, "wb")) || (fseek(writer->fh, writer->hdr->header_size, SEEK_SET) != 0)) {
+		goto failed;
+	}
+	return writer;
+
+failed:
+	errsv = errno;
+	state_discard(writer);
+	errno = errsv;
+	return NULL;
+}
+
+int
+state_write(state_writer_t* writer, uint32_t* cells) {
+	size_t   len, encoded;
+	uint8_t* data  = (uint8_t*) cells;
+	uint32_t c     = writer->next;
+	size_t   start = (size_t) c * STATE_CHUNK;
+	size_t   n     = (map_cells(writer->conf) - start < STATE_CHUNK) ? map_cells(writer->conf) - start : STATE_CHUNK;
+
+	/* Aliases */
+	state_header_t* hdr = writer->hdr;
+
+	if(c >= hdr->chunks_n) {
+		errno = EINVAL;
 		return 0;
 	}
 
-	if(fwrite(map, sizeof(uint32_t), mapsize, fh) != mapsize) {
-		errsv = errno;
-		fclose(fh);
-		errno = errsv;
+	len = sizeof(uint32_t) * n;
+	if(hdr->encoding != STATE_RAW) {
+		encoded = encode_cells(cells, n, writer->buf);
+		if(encoded < len) {
+			data = writer->buf;
+			len  = encoded;
+		}
+		header_offsets(hdr)[c + 1] = header_offsets(hdr)[c] + len;
+	}
+	header_sums(hdr)[c] = chunk_checksum(cells, n);
+
+	if(fwrite(data, 1, len, writer->fh) != len) {
 		return 0;
 	}
+	writer->next++;
+	return 1;
+}
 
-	fclose(fh);
+int
+state_commit(state_writer_t* writer, uint64_t samples) {
+	int errsv;
+
+	/* Aliases */
+	state_header_t* hdr = writer->hdr;
+
+	if(writer->next != hdr->chunks_n) {
+		errno = EINVAL;
+		goto failed;
+	}
+	hdr->jobs_done = header_jobs(writer->conf, samples);
+	describe_run(writer->conf, hdr, samples);
+
+	if((fseek(writer->fh, 0, SEEK_SET) != 0) || (fwrite(hdr, hdr->header_size, 1, writer->fh) != 1)) {
+		goto failed;
+	}
+	if(!close_synced(writer->fh)) {
+		writer->fh = NULL;
+		goto failed;
+	}
+	writer->fh = NULL;
+
+	if((rename(writer->tmppath, writer->conf->statefile) != 0) || !sync_dir(writer->conf->statefile)) {
+		goto failed;
+	}
+
+	free(writer->tmppath);
+	free(writer->hdr);
+	free(writer->buf);
+	free(writer);
 	return 1;
+
+failed:
+	errsv = errno;
+	state_discard(writer);
+	errno = errsv;
+	return 0;
+}
+
+void
+state_discard(state_writer_t* writer) {
+	if(writer->fh) {
+		fclose(writer->fh);
+	}
+	if(writer->tmppath) {
+		remove(writer->tmppath);
+	}
+	free(writer->tmppath);
+	free(writer->hdr);
+	free(writer->buf);
+	free(writer);
+}
+
+/* Size of a mapped statefile */
+static size_t
+state_size(config_t* conf) {
+	return header_size(conf, STATE_VERSION, STATE_RAW) + sizeof(uint32_t) * map_cells(conf);
+}
+
+uint32_t*
+state_map(config_t* conf, int shared, uint64_t* samples) {
+	int             fd;
+	int             errsv;
+	int             created = 0;
+	struct stat     st;
+	chunk_io_t      io;
+	state_header_t  fixed;
+	state_header_t* hdr  = MAP_FAILED;
+	uint64_t*       sums = NULL;
+	uint32_t*       map;
+	size_t          size = state_size(conf);
+
+	if((fd = open(conf->statefile, O_RDWR | O_CREAT, 0644)) < 0) {
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0) {
+		goto failed;
+	}
+
+	/* A new statefile is extended with zeros (without writing them). */
+	if(st.st_size == 0) {
+		if(ftruncate(fd, size) != 0) {
+			goto failed;
+		}
+		created = 1;
+	} else {
+		memset(&fixed, 0, sizeof(state_header_t));
+		if(!read_all(fd, &fixed, (st.st_size < (off_t) sizeof(state_header_t)) ? st.st_size : sizeof(state_header_t), 0)) {
+			goto failed;
+		}
+		if(
+		        ((size_t) st.st_size == sizeof(uint32_t) * (1 + map_cells(conf))) ||
+		        ((memcmp(fixed.magic, STATE_MAGIC, sizeof(fixed.magic)) == 0) &&
+		         ((fixed.version != STATE_VERSION) || (fixed.encoding != STATE_RAW)))) {
+			fprintf(stderr, "Statefile %s is compressed or has an older format, continue it once with mmap=0 and compress=0 to convert it.\n", conf->statefile);
+			errno = EINVAL;
+			goto failed;
+		}
+		if(!check_geometry(conf, &fixed, st.st_size)) {
+			goto failed;
+		}
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if(hdr == MAP_FAILED) {
+		goto failed;
+	}
+	map = (uint32_t*) ((char*) hdr + header_size(conf, STATE_VERSION, STATE_RAW));
+
+	if(created) {
+		init_header(conf, hdr, 0, STATE_RAW);
+		describe_run(conf, hdr, 0);
+		if(!state_sync(conf, map, 0, NULL)) {
+			goto failed;
+		}
+	}
+	if(!check_run(conf, hdr, samples)) {
+		goto failed;
+	}
+
+	/* Reading the whole statefile would page in the map, which mmap=1 avoids otherwise. */
+	if(shared && !created && conf->verify) {
+		if(!(sums = malloc(sizeof(uint64_t) * hdr->chunks_n))) {
+			goto failed;
+		}
+		init_io(&io, conf, map, sums);
+		if(!run_chunks(&io, checksum_chunk, 0, hdr->chunks_n) || !verify_chunks(conf, hdr, sums)) {
+			goto failed;
+		}
+		free(sums);
+	}
+
+	close(fd);
+	return map;
+
+failed:
+	errsv = errno;
+	if(hdr != MAP_FAILED) {
+		munmap(hdr, size);
+	}
+	free(sums);
+	close(fd);
+	errno = errsv;
+	return NULL;
+}
+
+int
+state_dirty(config_t* conf, uint32_t* map) {
+	state_header_t* hdr = mapped_header(conf, map);
+
+	hdr->jobs_done = STATE_DIRTY;
+	return msync(hdr, sizeof(state_header_t), MS_SYNC) == 0;
+}
+
+/*
+ * The map and the checksums are written before jobs_done, so the header never counts samples that
+ * aren't on disk yet. msync only writes the pages that changed since the last sync, and only the
+ * chunks in dirty are read for their checksums.
+ */
+int
+state_sync(config_t* conf, uint32_t* map, uint64_t samples, uint8_t* dirty) {
+	chunk_io_t      io;
+	state_header_t* hdr = mapped_header(conf, map);
+
+	describe_run(conf, hdr, samples);
+	init_io(&io, conf, map, header_sums(hdr));
+	io.dirty = dirty;
+	if(!run_chunks(&io, checksum_chunk, 0, hdr->chunks_n)) {
+		return 0;
+	}
+	if(msync(hdr, state_size(conf), MS_SYNC) != 0) {
+		return 0;
+	}
+	hdr->jobs_done = header_jobs(conf, samples);
+	return msync(hdr, sizeof(state_header_t), MS_SYNC) == 0;
+}
+
+uint32_t
+state_chunks(config_t* conf) {
+	return chunks_n(conf);
+}
+
+void
+state_unmap(config_t* conf, uint32_t* map) {
+	munmap(mapped_header(conf, map), state_size(conf));
 }
@@ -1,10 +1,126 @@
 #ifndef _nebula2_statefile_h_
 #define _nebula2_statefile_h_
 
+#include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "config.h"
 
-extern int state_load(config_t* conf, uint32_t* map, uint32_t* jobs_done);
-extern int state_save(config_t* conf, uint32_t* map, uint32_t jobs_done);
+#define STATE_MAGIC   "NEBULA2S"
+#define STATE_VERSION 4
+#define STATE_CHUNK   65536 /* Cells per chunk */
+
+/* Encodings of the chunks */
+#define STATE_RAW    0 /* The cells as they are */
+#define STATE_VARINT 1 /* Deltas and runs as varints (see statefile.c), chunks that don't get smaller are raw */
+
+/*
+ * A statefile starts with this header, followed by a checksum of every chunk of the map
+ * (uint64_t), the offsets of the encoded chunks (chunks_n + 1 uint64_t, relative to the end of
+ * the header, not with STATE_RAW) and the iterations of the layers (uint32_t), padded to
+ * header_size. Then come the chunks of STATE_CHUNK cells (the last one may be shorter).
+ * Everything is in host byte order. Statefiles of version 3 (without the MH and mask settings),
+ * version 2 (without encoding either) and of the first format (jobs_done followed by the map) can
+ * still be loaded.
+ */
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t jobs_done;   /* samples / jobsize, STATE_DIRTY while the map of a mapped statefile changes */
+	uint64_t samples;     /* Finished samples (they count, not the jobs) */
+	uint32_t jobsize;
+	uint32_t header_size; /* Offset of the map */
+	uint32_t width;       /* Of the map (half the image width with symmetry=fold) */
+	uint32_t height;
+	uint32_t iters_n;
+	uint32_t symmetry;
+	uint32_t sampler;
+	uint32_t mask;
+	uint32_t rng;
+	uint32_t chunks_n;
+	uint64_t seed;
+	uint32_t encoding;
+	uint32_t reserved;
+	uint32_t mhlayer;     /* The settings that scale the counts of sampler=mh and mask=1 (0 if unknown) */
+	uint32_t mhboost;
+	uint32_t maskres;
+	uint32_t maskweight;
+} state_header_t;
+
+/*
+ * Load the map and the number of finished samples. Statefiles of another size, iterations,
+ * symmetry, sampler or mask (or their settings) are rejected, as well as damaged ones (the chunks
+ * are read and verified in parallel). A missing statefile gives an empty map.
+ */
+extern int state_load(config_t* conf, uint32_t* map, uint64_t* samples);
+
+/* Save the map (encoded with compress=1). */
+extern int state_save(config_t* conf, uint32_t* map, uint64_t samples);
+
+/*
+ * With mmap=1, the map is the mapped statefile (after the header), so the workers accumulate
+ * into it directly and a save is an msync, which only writes the changed pages. While the map
+ * changes, the header is marked dirty, so the statefile of a crashed run isn't continued with a
+ * wrong sample count.
+ *
+ * state_map maps the statefile (creating it, if it doesn't exist). The chunks are only verified
+ * with verify=1 and shared = 1, since this reads the whole map. With shared = 0, changes of the
+ * map stay in memory (e.g. for render, which changes the map).
+ *
+ * state_sync only computes the checksums of the chunks flagged in dirty again (and clears the
+ * flags), NULL means any chunk may have changed. The flags have state_chunks entries.
+ */
+extern uint32_t* state_map(config_t* conf, int shared, uint64_t* samples);
+extern int       state_dirty(config_t* conf, uint32_t* map);
+extern int       state_sync(config_t* conf, uint32_t* map, uint64_t samples, uint8_t* dirty);
+extern void      state_unmap(config_t* conf, uint32_t* map);
+extern uint32_t  state_chunks(config_t* conf);
+
+/*
+ * Chunk by chunk access, for maps that don't need to fit into memory at once (see merge.c).
+ *
+ * state_config creates the config the statefile path was made with (size, iterations, symmetry,
+ * jobsize, sampler, mask and their settings, rng, seed and compress), free it with
+ * conf_destroy. Statefiles of the first format don't record it.
+ */
+extern int state_config(char* path, config_t** conf);
+
+/* A reader verifies the header against conf and every chunk it reads against its checksum. */
+typedef struct {
+	config_t        conf; /* statefile is the path of the reader */
+	int             fd;
+	state_header_t* hdr;
+	uint8_t*        buf; /* For an encoded chunk */
+	dev_t           dev; /* Of the file */
+	ino_t           ino;
+} state_reader_t;
+
+extern state_reader_t* state_open(config_t* conf, char* path);
+
+/* Are the statefiles of the readers the same file or copies of the same map? */
+extern int state_same(state_reader_t* a, state_reader_t* b);
+
+/* Read chunk c into cells (STATE_CHUNK cells), returns the number of cells or 0 on errors. */
+extern size_t state_read(state_reader_t* reader, uint32_t c, uint32_t* cells);
+extern void   state_close(state_reader_t* reader);
+
+/*
+ * A writer writes the chunks of the map of conf in order to a temporary file (encoded with
+ * compress=1), that replaces the statefile on state_commit. Both state_commit and state_discard
+ * free the writer.
+ */
+typedef struct {
+	config_t*       conf;
+	char*           tmppath;
+	FILE*           fh;
+	state_header_t* hdr;
+	uint8_t*        buf;  /* For an encoded chunk */
+	uint32_t        next; /* The chunk state_write writes */
+} state_writer_t;
+
+extern state_writer_t* state_create(config_t* conf);
+extern int             state_write(state_writer_t* writer, uint32_t* cells);
+extern int             state_commit(state_writer_t* writer, uint64_t samples);
+extern void            state_discard(state_writer_t* writer);
 
 #endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+int
+stats_init(stats_t* stats, int layers) {
+	stats->layers = layers;
+	if(!(stats->escaped = calloc(2 * layers, sizeof(uint64_t)))) {
+		return 0;
+	}
+	stats->deposited = stats->escaped + layers;
+	stats_clear(stats);
+	return 1;
+}
+
+void
+stats_cleanup(stats_t* stats) {
+	free(stats->escaped);
+	stats->escaped = NULL;
+}
+
+void
+stats_store(stats_t* dst, stats_t* src) {
+	int l;
+
+	__atomic_store_n(&(dst->samples), src->samples, __ATOMIC_RELAXED);
+	__atomic_store_n(&(dst->rejected), src->rejected, __ATOMIC_RELAXED);
+	for(l = 0; l < dst->layers; l++) {
+		__atomic_store_n(dst->escaped + l, src->escaped[l], __ATOMIC_RELAXED);
+		__atomic_store_n(dst->deposited + l, src->deposited[l], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&(dst->iterate_ns), src->iterate_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&(dst->scatter_ns), src->scatter_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&(dst->idle_ns), src->idle_ns, __ATOMIC_RELAXED);
+}
+
+void
+stats_add(stats_t* sum, stats_t* src) {
+	int l;
+
+	sum->samples   += __atomic_load_n(&(src->samples), __ATOMIC_RELAXED);
+	sum->rejected  += __atomic_load_n(&(src->rejected), __ATOMIC_RELAXED);
+	for(l = 0; l < sum->layers; l++) {
+		sum->escaped[l]   += __atomic_load_n(src->escaped + l, __ATOMIC_RELAXED);
+		sum->deposited[l] += __atomic_load_n(src->deposited + l, __ATOMIC_RELAXED);
+	}
+	sum->iterate_ns += __atomic_load_n(&(src->iterate_ns), __ATOMIC_RELAXED);
+	sum->scatter_ns += __atomic_load_n(&(src->scatter_ns), __ATOMIC_RELAXED);
+	sum->idle_ns    += __atomic_load_n(&(src->idle_ns), __ATOMIC_RELAXED);
+}
+
+void
+stats_clear(stats_t* stats) {
+	stats->samples    = 0;
+	stats->rejected   = 0;
+	stats->iterate_ns = 0;
+	stats->scatter_ns = 0;
+	stats->idle_ns    = 0;
+	memset(stats->escaped, 0, sizeof(uint64_t) * 2 * stats->layers);
+}
+
+void
+stats_copy(stats_t* dst, stats_t* src) {
+	uint64_t* escaped = dst->escaped;
+
+	*dst           = *src;
+	dst->escaped   = escaped;
+	dst->deposited = escaped + dst->layers;
+	memcpy(dst->escaped, src->escaped, sizeof(uint64_t) * src->layers);
+	memcpy(dst->deposited, src->deposited, sizeof(uint64_t) * src->layers);
+}
+
+/* Difference of a counter between cur and prev */
+#define DELTA(field) (cur->field - (prev ? prev->field : 0))
+
+void
+stats_print(stats_t* cur, stats_t* prev, double seconds) {
+	int      l;
+	uint64_t samples, time, deposited = 0;
+
+	if(seconds <= 0) {
+		return;
+	}
+
+	samples = DELTA(samples);
+	printf("Samples/s: %.0f (%.1f%% rejected by cardioid/bulb test)\n", samples / seconds,
+	       samples ? 100.0 * DELTA(rejected) / samples : 0.0);
+
+	fputs("Escapes/s:", stdout);
+	for(l = 0; l < cur->layers; l++) {
+		printf(" %.0f", (cur->escaped[l] - (prev ? prev->escaped[l] : 0)) / seconds);
+		deposited += cur->deposited[l] - (prev ? prev->deposited[l] : 0);
+	}
+	putchar('\n');
+	printf("Deposits/s: %.0f\n", deposited / seconds);
+
+	time = DELTA(iterate_ns) + DELTA(scatter_ns) + DELTA(idle_ns);
+	if(time > 0) {
+		printf("Time: %.1f%% iterate, %.1f%% scatter, %.1f%% idle\n", 100.0 * DELTA(iterate_ns) / time,
+		       100.0 * DELTA(scatter_ns) / time, 100.0 * DELTA(idle_ns) / time);
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef _nebula2_stats_h_
+#define _nebula2_stats_h_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Throughput counters of a worker. The worker counts privately and publishes its totals after
+ * every job with stats_store(), so the main thread can read them at any time without slowing the
+ * workers down.
+ *
+ * The time of a worker is split into iterate (orbit kernel), scatter (adding points to the map)
+ * and idle (claiming jobs, waiting at the end). The single pass kernel scatters every orbit right
+ * after iterating it, so its scatter time is part of iterate. Only the scatter phases of the
+ * two-phase mode and the prefilter and merging shards count as scatter.
+ */
+typedef struct {
+	int layers;
+
+	uint64_t  samples;   /* Samples drawn */
+	uint64_t  rejected;  /* Samples skipped by the cardioid/bulb test */
+	uint64_t* escaped;   /* Scattered orbits of every layer */
+	uint64_t* deposited; /* Points scattered into every layer (allocated together with escaped) */
+
+	uint64_t iterate_ns;
+	uint64_t scatter_ns;
+	uint64_t idle_ns;
+} stats_t;
+
+/* Monotonic clock in ns */
+inline static uint64_t
+now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+extern int stats_init(stats_t* stats, int layers);
+extern void stats_cleanup(stats_t* stats);
+
+/* Publish the counters src (atomically, field by field) to dst. */
+extern void stats_store(stats_t* dst, stats_t* src);
+
+/* Add the published counters src to sum. */
+extern void stats_add(stats_t* sum, stats_t* src);
+
+extern void stats_clear(stats_t* stats);
+
+/* Copy the counters of src to dst (both must have the same number of layers). */
+extern void stats_copy(stats_t* dst, stats_t* src);
+
+/*
+ * Print the rates of the counters between prev and cur (cur only, if prev is NULL), that were
+ * collected in the given time.
+ */
+extern void stats_print(stats_t* cur, stats_t* prev, double seconds);
+
+#endif